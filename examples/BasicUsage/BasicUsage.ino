@@ -19,6 +19,17 @@
 #define CONFIG_DEFAULT_ServerPort       8080
 #define CONFIG_DEFAULT_UpdateInterval   60000LL  // milliseconds
 
+//==============================================================================
+// List your configuration variables
+//==============================================================================
+#define MYCONFIG_VARIABLES(X)           \
+    X(String,  DeviceName)              \
+    X(String,  WifiSSID)                \
+    X(String,  WifiPassword)            \
+    X(Bool,    EnableDebug)             \
+    X(UShort,  ServerPort)              \
+    X(Long64,  UpdateInterval)
+
 //==============================================================================
 // Define your configuration class
 //==============================================================================
@@ -29,12 +40,7 @@ class MyConfig : public zPref
 
     public:
         // Declare your configuration variables using the macro
-        DECLARE_CONFIG_VARIABLE(String,  DeviceName);
-        DECLARE_CONFIG_VARIABLE(String,  WifiSSID);
-        DECLARE_CONFIG_VARIABLE(String,  WifiPassword);
-        DECLARE_CONFIG_VARIABLE(Bool,    EnableDebug);
-        DECLARE_CONFIG_VARIABLE(UShort,  ServerPort);
-        DECLARE_CONFIG_VARIABLE(Long64,  UpdateInterval);
+        ZPREF_VARIABLES(MYCONFIG_VARIABLES)
 
     public:
         MyConfig() : zPref("MyApp", CONFIG_VERSION) {}
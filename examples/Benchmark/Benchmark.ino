@@ -0,0 +1,144 @@
+/*==============================================================================
+   zPref Example - Benchmark
+
+   Measures the cost of the common operations for 10, 100 and 1000 variables.
+   The variables live in zPrefMemoryStorage, so the numbers exclude flash
+   access, and the sketch also builds for the host - see extras/host.
+  ============================================================================*/
+
+#include <Arduino.h>
+#include <logger.h>
+#include <zPref.h>
+
+//==============================================================================
+// A configuration with a variable count chosen at run time
+//==============================================================================
+class BenchConfig : public zPref
+{
+    private:
+        static const size_t KEY_SIZE = 6;   // "V0000" and the terminator
+
+        std::vector<char> _keys;
+        std::vector<zPrefVariable<UShort>*> _vars;
+        std::vector<zPrefVariableBase*> _variables;
+        std::vector<uint16_t> _index;
+        std::vector<uint16_t> _hashIndex;
+        std::vector<zPrefSchemaEntry> _schema;
+
+    protected:
+        // What ZPREF_VARIABLES generates at compile time
+        zPrefRegistry registry() override {
+            return zPrefRegistry{ _variables.data(), _index.data(), _schema.data(), _variables.size(), _hashIndex.data() };
+        }
+
+    public:
+        BenchConfig(const char* ns, size_t count, zPrefStorage& storage) :
+            zPref(ns, 1), _keys(count * KEY_SIZE), _index(count), _hashIndex(count)
+        {
+            SetStorage(storage);
+            for (size_t i = 0; i < count; i++) {
+                char* key = &_keys[i * KEY_SIZE];
+                snprintf(key, KEY_SIZE, "V%04u", (unsigned)i);
+                _vars.push_back(new zPrefVariable<UShort>(key, 0, *this));
+                _variables.push_back(_vars.back());
+                _schema.push_back(zPrefSchemaEntry{ key, eZPrefUShort });
+            }
+        }
+
+        ~BenchConfig() {
+            for (auto var : _vars) {
+                delete var;
+            }
+        }
+
+        size_t Count() { return _vars.size(); }
+        zPrefVariable<UShort>& operator[](size_t i) { return *_vars[i]; }
+        const char* Key(size_t i) { return &_keys[i * KEY_SIZE]; }
+};
+
+//==============================================================================
+// Benchmark
+//==============================================================================
+static void report(const char* name, size_t count, uint32_t startUs) {
+    uint32_t us = micros() - startUs;
+    Serial.printf("  %-22s %8u us total %10.3f us/op\n", name, (unsigned)us, (double)us / count);
+}
+
+static void bench(const char* ns, size_t count) {
+    zPrefMemoryStorage storage;
+    Serial.printf("%u variables\n", (unsigned)count);
+
+    uint32_t start = micros();
+    BenchConfig* config = new BenchConfig(ns, count, storage);
+    config->Init();
+    report("Init (lazy)", 1, start);
+
+    BenchConfig& c = *config;
+    start = micros();
+    for (size_t i = 0; i < count; i++) {
+        c[i] = (UShort)i;
+    }
+    report("Set with commit", count, start);
+
+    start = micros();
+    c.BeginBatch();
+    for (size_t i = 0; i < count; i++) {
+        c[i] = (UShort)(i + 1);
+    }
+    report("Set without commit", count, start);
+    start = micros();
+    c.CommitBatch();
+    report("CommitBatch", 1, start);
+
+    volatile uint32_t sink = 0;
+    start = micros();
+    for (size_t i = 0; i < count; i++) {
+        sink += c[i].Get();
+    }
+    report("Get", count, start);
+
+    start = micros();
+    for (size_t i = 0; i < count; i++) {
+        sink += (c.Find(c.Key(i)) != nullptr);
+    }
+    report("Find", count, start);
+
+    start = micros();
+    for (size_t i = 0; i < count; i++) {
+        c.Set(c.Key(i), "1234");
+    }
+    report("FromString", count, start);
+
+    char buf[8];
+    start = micros();
+    for (size_t i = 0; i < count; i++) {
+        c.GetString(c.Key(i), buf, sizeof(buf));
+    }
+    report("GetString", count, start);
+
+    // A second instance over the same storage sees the values written above
+    start = micros();
+    BenchConfig* reloaded = new BenchConfig(ns, count, storage);
+    reloaded->Init(NVS_DEFAULT_PART_NAME, true);
+    report("Init (preload)", 1, start);
+
+    Serial.printf("  storage: %u gets, %u sets, %u commits\n",
+        (unsigned)storage.gets, (unsigned)storage.sets, (unsigned)storage.commits);
+    delete reloaded;
+    delete config;
+}
+
+void setup() {
+    Serial.begin(115200);
+    delay(1000);
+    LogInit(NULL);
+
+    bench("Bench10", 10);
+    bench("Bench100", 100);
+    bench("Bench1000", 1000);
+}
+
+void loop() {
+    LogTask();
+    delay(10);
+}
@@ -0,0 +1,195 @@
+/*==============================================================================
+   zPref - host shim of the Arduino core, FreeRTOS and ESP-IDF
+
+   Copyright 2020-2026 Ivan Vasilev, Zmei Research Ltd.
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+  ============================================================================*/
+
+
+//==============================================================================
+//  Includes
+//==============================================================================
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "Arduino.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "freertos/task.h"
+
+//==============================================================================
+//  Arduino core
+//==============================================================================
+HardwareSerial Serial;
+
+static int64_t elapsedUs()
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+unsigned long millis() { return (unsigned long)(elapsedUs() / 1000); }
+unsigned long micros() { return (unsigned long)elapsedUs(); }
+void delay(unsigned long ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+int64_t esp_timer_get_time() { return elapsedUs(); }
+
+//==============================================================================
+//  ESP-IDF
+//==============================================================================
+const char * esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+        case ESP_OK:                        return "ESP_OK";
+        case ESP_FAIL:                      return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:                return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:           return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:         return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:          return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND:             return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED:         return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_NVS_NOT_INITIALIZED:   return "ESP_ERR_NVS_NOT_INITIALIZED";
+        case ESP_ERR_NVS_NOT_FOUND:         return "ESP_ERR_NVS_NOT_FOUND";
+        case ESP_ERR_NVS_TYPE_MISMATCH:     return "ESP_ERR_NVS_TYPE_MISMATCH";
+        case ESP_ERR_NVS_INVALID_HANDLE:    return "ESP_ERR_NVS_INVALID_HANDLE";
+        case ESP_ERR_NVS_KEY_TOO_LONG:      return "ESP_ERR_NVS_KEY_TOO_LONG";
+        case ESP_ERR_NVS_INVALID_LENGTH:    return "ESP_ERR_NVS_INVALID_LENGTH";
+        case ESP_ERR_NVS_NO_FREE_PAGES:     return "ESP_ERR_NVS_NO_FREE_PAGES";
+        case ESP_ERR_NVS_NEW_VERSION_FOUND: return "ESP_ERR_NVS_NEW_VERSION_FOUND";
+        default:                            return "UNKNOWN ERROR";
+    }
+}
+
+//==============================================================================
+//  NVS - no flash on the host, zPrefMemoryStorage takes its place
+//==============================================================================
+esp_err_t nvs_flash_init_partition(const char *) { return ESP_ERR_NOT_SUPPORTED; }
+esp_err_t nvs_flash_erase_partition(const char *) { return ESP_ERR_NOT_SUPPORTED; }
+
+esp_err_t nvs_open(const char *, nvs_open_mode_t, nvs_handle_t *) { return ESP_ERR_NOT_SUPPORTED; }
+esp_err_t nvs_open_from_partition(const char *, const char *, nvs_open_mode_t, nvs_handle_t *) { return ESP_ERR_NOT_SUPPORTED; }
+void nvs_close(nvs_handle_t) {}
+esp_err_t nvs_commit(nvs_handle_t) { return ESP_ERR_NVS_INVALID_HANDLE; }
+esp_err_t nvs_erase_key(nvs_handle_t, const char *) { return ESP_ERR_NVS_INVALID_HANDLE; }
+esp_err_t nvs_erase_all(nvs_handle_t) { return ESP_ERR_NVS_INVALID_HANDLE; }
+
+#define HOST_NVS_INTEGER(suffix, type) \
+    esp_err_t nvs_get_##suffix(nvs_handle_t, const char *, type *) { return ESP_ERR_NVS_INVALID_HANDLE; } \
+    esp_err_t nvs_set_##suffix(nvs_handle_t, const char *, type) { return ESP_ERR_NVS_INVALID_HANDLE; }
+
+HOST_NVS_INTEGER(i8, int8_t)
+HOST_NVS_INTEGER(u8, uint8_t)
+HOST_NVS_INTEGER(i16, int16_t)
+HOST_NVS_INTEGER(u16, uint16_t)
+HOST_NVS_INTEGER(i32, int32_t)
+HOST_NVS_INTEGER(u32, uint32_t)
+HOST_NVS_INTEGER(i64, int64_t)
+HOST_NVS_INTEGER(u64, uint64_t)
+
+esp_err_t nvs_get_str(nvs_handle_t, const char *, char *, size_t *) { return ESP_ERR_NVS_INVALID_HANDLE; }
+esp_err_t nvs_get_blob(nvs_handle_t, const char *, void *, size_t *) { return ESP_ERR_NVS_INVALID_HANDLE; }
+esp_err_t nvs_set_str(nvs_handle_t, const char *, const char *) { return ESP_ERR_NVS_INVALID_HANDLE; }
+esp_err_t nvs_set_blob(nvs_handle_t, const char *, const void *, size_t) { return ESP_ERR_NVS_INVALID_HANDLE; }
+
+esp_err_t nvs_entry_find(const char *, const char *, nvs_type_t, nvs_iterator_t * it)
+{
+    *it = nullptr;
+    return ESP_ERR_NOT_SUPPORTED;
+}
+esp_err_t nvs_entry_next(nvs_iterator_t *) { return ESP_ERR_NVS_INVALID_HANDLE; }
+esp_err_t nvs_entry_info(const nvs_iterator_t, nvs_entry_info_t *) { return ESP_ERR_NVS_INVALID_HANDLE; }
+void nvs_release_iterator(nvs_iterator_t) {}
+
+esp_err_t nvs_get_stats(const char *, nvs_stats_t *) { return ESP_ERR_NOT_SUPPORTED; }
+esp_err_t nvs_get_used_entry_count(nvs_handle_t, size_t *) { return ESP_ERR_NVS_INVALID_HANDLE; }
+
+//==============================================================================
+//  FreeRTOS - a task is a detached std::thread with a notification count
+//==============================================================================
+struct tskTaskControlBlock {
+    std::mutex              lock;
+    std::condition_variable notified;
+    uint32_t                count = 0;
+};
+
+static thread_local TaskHandle_t currentTask = nullptr;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *, uint32_t,
+    void * param, UBaseType_t, TaskHandle_t * handle, BaseType_t)
+{
+    TaskHandle_t tcb = new tskTaskControlBlock;
+    if (handle != nullptr) {
+        *handle = tcb;
+    }
+    std::thread([task, param, tcb] {
+        currentTask = tcb;
+        task(param);        // Returns from vTaskDelete(NULL)
+    }).detach();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char * name, uint32_t stackDepth,
+    void * param, UBaseType_t priority, TaskHandle_t * handle)
+{
+    return xTaskCreatePinnedToCore(task, name, stackDepth, param, priority, handle, tskNO_AFFINITY);
+}
+
+// The block of a finished task is kept - its handle may still be notified
+void vTaskDelete(TaskHandle_t) {}
+
+void vTaskDelay(TickType_t ticks) { std::this_thread::sleep_for(std::chrono::milliseconds(ticks)); }
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    if (currentTask == nullptr) {
+        currentTask = new tskTaskControlBlock;  // A thread the shim did not start, e.g. main()
+    }
+    return currentTask;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t) { return 1; }
+
+void xTaskNotifyGive(TaskHandle_t handle)
+{
+    std::lock_guard<std::mutex> guard(handle->lock);
+    handle->count++;
+    handle->notified.notify_all();
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks)
+{
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> guard(self->lock);
+    if (ticks == portMAX_DELAY) {
+        self->notified.wait(guard, [self] { return self->count > 0; });
+    } else {
+        self->notified.wait_for(guard, std::chrono::milliseconds(ticks), [self] { return self->count > 0; });
+    }
+    uint32_t count = self->count;
+    if (clearOnExit) {
+        self->count = 0;
+    } else if (count > 0) {
+        self->count--;
+    }
+    return count;
+}
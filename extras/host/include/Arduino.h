@@ -0,0 +1,28 @@
+// Host stand-in for the Arduino core - what zPref and the examples use
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+// Serial prints to stdout and never has input
+class HardwareSerial : public Stream {
+    public:
+        void begin(unsigned long) {};
+        size_t write(uint8_t c) { return (putchar(c) == EOF) ? 0 : 1; };
+        using Print::write;
+        int available() { return 0; };
+        int read() { return -1; };
+        int peek() { return -1; };
+};
+
+extern HardwareSerial Serial;
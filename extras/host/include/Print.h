@@ -0,0 +1,37 @@
+// Host stand-in for the Arduino Print class
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+class Print {
+    public:
+        virtual ~Print() {};
+
+        virtual size_t write(uint8_t c) = 0;
+        virtual size_t write(const uint8_t * buf, size_t len) {
+            size_t n = 0;
+            while (len--) {
+                n += write(*buf++);
+            }
+            return n;
+        };
+        size_t write(const char * str) { return write((const uint8_t*)str, strlen(str)); };
+        size_t write(const char * buf, size_t len) { return write((const uint8_t*)buf, len); };
+
+        size_t print(const char * str) { return write(str); };
+        size_t println(const char * str) { return write(str) + write("\n"); };
+        size_t printf(const char * format, ...) __attribute__((format(printf, 2, 3))) {
+            char buf[256];
+            va_list args;
+            va_start(args, format);
+            int len = vsnprintf(buf, sizeof(buf), format, args);
+            va_end(args);
+            if (len < 0) {
+                return 0;
+            }
+            return write((const uint8_t*)buf, ((size_t)len < sizeof(buf)) ? (size_t)len : sizeof(buf) - 1);
+        };
+};
@@ -0,0 +1,30 @@
+// Host stand-in for the Arduino Stream class, without timeouts
+#pragma once
+
+#include "Print.h"
+
+class Stream : public Print {
+    public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+
+        size_t readBytes(char * buf, size_t len) {
+            size_t n = 0;
+            while ((n < len) && (available() > 0)) {
+                buf[n++] = (char)read();
+            }
+            return n;
+        };
+        size_t readBytesUntil(char terminator, char * buf, size_t len) {
+            size_t n = 0;
+            while ((n < len) && (available() > 0)) {
+                int c = read();
+                if (c == terminator) {
+                    break;
+                }
+                buf[n++] = (char)c;
+            }
+            return n;
+        };
+};
@@ -0,0 +1,58 @@
+// Host stand-in for the Arduino String class, backed by std::string
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+class String {
+    public:
+        String() {};
+        String(const char * str): _str(str ? str : "") {};
+        String(char c): _str(1, c) {};
+        String(bool val): _str(val ? "1" : "0") {};
+        String(unsigned char val): _str(std::to_string(val)) {};
+        String(signed char val): _str(std::to_string(val)) {};
+        String(short val): _str(std::to_string(val)) {};
+        String(unsigned short val): _str(std::to_string(val)) {};
+        String(int val): _str(std::to_string(val)) {};
+        String(unsigned int val): _str(std::to_string(val)) {};
+        String(long val): _str(std::to_string(val)) {};
+        String(unsigned long val): _str(std::to_string(val)) {};
+        String(long long val): _str(std::to_string(val)) {};
+        String(unsigned long long val): _str(std::to_string(val)) {};
+        String(float val, unsigned int decimals = 2) { format(val, decimals); };
+        String(double val, unsigned int decimals = 2) { format(val, decimals); };
+
+        const char * c_str() const { return _str.c_str(); };
+        unsigned int length() const { return (unsigned int)_str.size(); };
+        bool reserve(unsigned int size) { _str.reserve(size); return true; };
+        bool concat(const char * str, unsigned int len) { _str.append(str, len); return true; };
+        bool equals(const String& other) const { return _str == other._str; };
+        bool equals(const char * other) const { return _str == other; };
+        void toCharArray(char * buf, unsigned int len) const {
+            if (len == 0) {
+                return;
+            }
+            size_t n = (_str.size() < len - 1) ? _str.size() : len - 1;
+            memcpy(buf, _str.data(), n);
+            buf[n] = '\0';
+        };
+
+        char operator[](unsigned int index) const { return _str[index]; };
+        bool operator==(const String& other) const { return _str == other._str; };
+        bool operator!=(const String& other) const { return _str != other._str; };
+        bool operator<(const String& other) const { return _str < other._str; };
+        String& operator+=(const String& other) { _str += other._str; return *this; };
+        String& operator+=(const char * other) { _str += other; return *this; };
+        String& operator+=(char c) { _str += c; return *this; };
+
+    private:
+        std::string _str;
+
+        void format(double val, unsigned int decimals) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%.*f", (int)decimals, val);
+            _str = buf;
+        };
+};
@@ -0,0 +1,5 @@
+// Host stand-in - the host build follows the ESP-IDF 5 code paths
+#pragma once
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch)    (((major) << 16) | ((minor) << 8) | (patch))
+#define ESP_IDF_VERSION                             ESP_IDF_VERSION_VAL(5, 1, 0)
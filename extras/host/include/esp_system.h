@@ -0,0 +1,9 @@
+// Host stand-in - there is no restart to hook on the host
+#pragma once
+
+#include "esp_err.h"
+
+typedef void (*shutdown_handler_t)(void);
+
+inline esp_err_t esp_register_shutdown_handler(shutdown_handler_t) { return ESP_OK; }
+inline esp_err_t esp_unregister_shutdown_handler(shutdown_handler_t) { return ESP_OK; }
@@ -0,0 +1,18 @@
+// Host stand-in for FreeRTOS - tasks are std::threads, one tick is a millisecond
+#pragma once
+
+#include <stdint.h>
+
+typedef uint32_t    TickType_t;
+typedef int         BaseType_t;
+typedef unsigned    UBaseType_t;
+
+#define pdFALSE                 0
+#define pdTRUE                  1
+#define pdPASS                  1
+#define portMAX_DELAY           0xffffffffu
+#define portNUM_PROCESSORS      2
+#define tskNO_AFFINITY          0x7fffffff
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(ms))
+
+inline BaseType_t xPortGetCoreID() { return 0; }
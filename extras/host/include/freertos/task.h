@@ -0,0 +1,19 @@
+// Host stand-in for the FreeRTOS task API zPref uses - tasks and notifications
+#pragma once
+
+#include "FreeRTOS.h"
+
+struct tskTaskControlBlock;
+typedef tskTaskControlBlock* TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char * name, uint32_t stackDepth,
+    void * param, UBaseType_t priority, TaskHandle_t * handle, BaseType_t core);
+BaseType_t xTaskCreate(TaskFunction_t task, const char * name, uint32_t stackDepth,
+    void * param, UBaseType_t priority, TaskHandle_t * handle);
+void vTaskDelete(TaskHandle_t handle);
+void vTaskDelay(TickType_t ticks);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+UBaseType_t uxTaskPriorityGet(TaskHandle_t handle);
+void xTaskNotifyGive(TaskHandle_t handle);
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks);
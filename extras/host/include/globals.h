@@ -0,0 +1,18 @@
+// Host stand-in for zGlobals - the status codes and type names zPref uses
+#pragma once
+
+#include <stdint.h>
+
+typedef enum {
+    eOK = 0,
+    eFAILED,
+    eNOTINITIALIZED,
+    eINPROGRESS,
+    eINVALIDARG,
+    eBUSY
+} eStatus;
+
+typedef bool        Bool;
+typedef uint8_t     UChar;
+typedef uint16_t    UShort;
+typedef long long   Long64;
@@ -0,0 +1,22 @@
+// Host stand-in for zLogger - LOG() prints info and above to stdout
+#pragma once
+
+#include <stdio.h>
+
+typedef enum {
+    eLogDebug,
+    eLogInfo,
+    eLogWarn,
+    eLogError,
+    eLogCrit
+} eLogLevel;
+
+#define LOG(level, format, ...) \
+    do { \
+        if ((level) >= eLogInfo) { \
+            printf("[%s] " format "\n", CMP_NAME, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+inline void LogInit(void *) {}
+inline void LogTask() {}
@@ -0,0 +1,7 @@
+// Host stand-in - there is no flash, see nvs.h
+#pragma once
+
+#include "nvs.h"
+
+esp_err_t nvs_flash_init_partition(const char * partition);
+esp_err_t nvs_flash_erase_partition(const char * partition);
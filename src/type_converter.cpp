@@ -27,7 +27,11 @@
 //==============================================================================
 //  Includes
 //==============================================================================
-#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
 #include "WString.h"
 #include "type_converter.hpp"
 
@@ -51,6 +55,243 @@
 //==============================================================================
 //  Local functions
 //==============================================================================
+static size_t formatDecimal(unsigned long long val, bool negative, char * const buf, size_t len)
+{
+    char digits[20];    // Enough for 2^64 - 1
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + (val % 10));
+        val /= 10;
+    } while (val > 0);
+
+    size_t required = count + (negative ? 1 : 0);
+    if (required < len) {
+        char* p = buf;
+        if (negative) {
+            *p++ = '-';
+        }
+        while (count > 0) {
+            *p++ = digits[--count];
+        }
+        *p = '\0';
+    }
+    return required;
+}
+
+static size_t formatSigned(long long val, char * const buf, size_t len)
+{
+    // Negate in unsigned space so LLONG_MIN does not overflow
+    unsigned long long mag = (val < 0) ? (0ULL - (unsigned long long)val) : (unsigned long long)val;
+    return formatDecimal(mag, val < 0, buf, len);
+}
+
+static bool isSpace(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+static const char* skipSpace(const char* p)
+{
+    while (isSpace(*p)) {
+        p++;
+    }
+    return p;
+}
+
+// Parse the magnitude of an integer, p points past any sign
+static eConvResult parseMagnitude(const char* p, unsigned long long max, unsigned long long& out)
+{
+    unsigned base = 10;
+    if ((p[0] == '0') && ((p[1] == 'x') || (p[1] == 'X'))) {
+        base = 16;
+        p += 2;
+    }
+
+    unsigned long long mag = 0;
+    bool overflow = false;
+    const char* start = p;
+    for (;; p++) {
+        unsigned digit;
+        if ((*p >= '0') && (*p <= '9')) {
+            digit = *p - '0';
+        } else if ((base == 16) && (*p >= 'a') && (*p <= 'f')) {
+            digit = *p - 'a' + 10;
+        } else if ((base == 16) && (*p >= 'A') && (*p <= 'F')) {
+            digit = *p - 'A' + 10;
+        } else {
+            break;
+        }
+        if (mag > (max - digit) / base) {
+            overflow = true;    // Keep scanning so trailing garbage is still a format error
+        } else {
+            mag = mag * base + digit;
+        }
+    }
+
+    if ((p == start) || (*skipSpace(p) != '\0')) {
+        return eConvFormat;
+    }
+    if (overflow) {
+        return eConvRange;
+    }
+    out = mag;
+    return eConvOk;
+}
+
+static eConvResult parseUnsigned(const char * const val, unsigned long long max, unsigned long long& out)
+{
+    if (val == NULL) {
+        return eConvFormat;
+    }
+    const char* p = skipSpace(val);
+    bool negative = false;
+    if ((*p == '+') || (*p == '-')) {
+        negative = (*p == '-');
+        p++;
+    }
+
+    unsigned long long mag;
+    eConvResult res = parseMagnitude(p, max, mag);
+    if (res != eConvOk) {
+        return res;
+    }
+    if (negative && (mag != 0)) {
+        return eConvRange;
+    }
+    out = mag;
+    return eConvOk;
+}
+
+static eConvResult parseSigned(const char * const val, long long min, long long max, long long& out)
+{
+    if (val == NULL) {
+        return eConvFormat;
+    }
+    const char* p = skipSpace(val);
+    bool negative = false;
+    if ((*p == '+') || (*p == '-')) {
+        negative = (*p == '-');
+        p++;
+    }
+
+    // Magnitude of min is one more than max for two's complement
+    unsigned long long limit = negative ? (0ULL - (unsigned long long)min) : (unsigned long long)max;
+    unsigned long long mag;
+    eConvResult res = parseMagnitude(p, limit, mag);
+    if (res != eConvOk) {
+        return res;
+    }
+    out = negative ? (long long)(0ULL - mag) : (long long)mag;
+    return eConvOk;
+}
+
+// Skips word when p starts with it, ignoring case
+static bool skipWord(const char*& p, const char * const word)
+{
+    size_t i = 0;
+    for (; word[i] != '\0'; i++) {
+        if ((p[i] | 0x20) != word[i]) {
+            return false;
+        }
+    }
+    p += i;
+    return true;
+}
+
+// The inf and nan formatValue() prints, optionally signed - strtod() reads them back
+static bool isNonFinite(const char * const val)
+{
+    const char* p = skipSpace(val);
+    if ((*p == '+') || (*p == '-')) {
+        p++;
+    }
+    if (!skipWord(p, "infinity") && !skipWord(p, "inf") && !skipWord(p, "nan")) {
+        return false;
+    }
+    return *skipSpace(p) == '\0';
+}
+
+// Accepts the decimal syntax only - strtod() alone would also take hex, nan(...)
+// and leading garbage
+static eConvResult checkDecimal(const char * const val)
+{
+    if (val == NULL) {
+        return eConvFormat;
+    }
+    const char* p = skipSpace(val);
+    if ((*p == '+') || (*p == '-')) {
+        p++;
+    }
+
+    bool any = false;
+    for (; (*p >= '0') && (*p <= '9'); p++) {
+        any = true;
+    }
+    if (*p == '.') {
+        for (p++; (*p >= '0') && (*p <= '9'); p++) {
+            any = true;
+        }
+    }
+    if (!any) {
+        return eConvFormat;
+    }
+
+    if ((*p == 'e') || (*p == 'E')) {
+        p++;
+        if ((*p == '+') || (*p == '-')) {
+            p++;
+        }
+        if ((*p < '0') || (*p > '9')) {
+            return eConvFormat;
+        }
+        for (; (*p >= '0') && (*p <= '9'); p++) {
+        }
+    }
+
+    return (*skipSpace(p) == '\0') ? eConvOk : eConvFormat;
+}
+
+// Converted by the C library, which rounds correctly - formatValue() output reads back unchanged
+template<typename F>
+static eConvResult parseDecimal(const char * const val, F (*convert)(const char*, char**), F max, F& out)
+{
+    if ((val != NULL) && isNonFinite(val)) {
+        out = convert(val, NULL);
+        return eConvOk;
+    }
+    eConvResult res = checkDecimal(val);
+    if (res != eConvOk) {
+        return res;
+    }
+    F result = convert(val, NULL);
+    if ((result > max) || (result < -max)) {
+        return eConvRange;      // Overflowed to infinity
+    }
+    out = result;
+    return eConvOk;
+}
+
+template<typename C>
+static eConvResult parseUnsignedAs(const char * const val, unsigned long long max, C& out)
+{
+    unsigned long long tmp;
+    eConvResult res = parseUnsigned(val, max, tmp);
+    if (res == eConvOk) {
+        out = (C)tmp;
+    }
+    return res;
+}
+
+template<typename C>
+static eConvResult parseSignedAs(const char * const val, long long min, long long max, C& out)
+{
+    long long tmp;
+    eConvResult res = parseSigned(val, min, max, tmp);
+    if (res == eConvOk) {
+        out = (C)tmp;
+    }
+    return res;
+}
 
 //==============================================================================
 //  Exported data
@@ -61,34 +302,163 @@
 //==============================================================================
 
 template<>
-String getValue_as(const char * const val) {
-    return String(val);
+eConvResult parseValue(const char * const val, String& out) {
+    if (val == NULL) {
+        return eConvFormat;
+    }
+    out = String(val);
+    return eConvOk;
 }
 
 template<>
-bool getValue_as(const char * const val) {
-    return String(val).equals("true") || String(val).equals("1") || String(val).equals("True");
+eConvResult parseValue(const char * const val, bool& out) {
+    if (val == NULL) {
+        return eConvFormat;
+    }
+    if (!strcmp(val, "1") || !strcmp(val, "true") || !strcmp(val, "True") || !strcmp(val, "TRUE")) {
+        out = true;
+        return eConvOk;
+    }
+    if (!strcmp(val, "0") || !strcmp(val, "false") || !strcmp(val, "False") || !strcmp(val, "FALSE")) {
+        out = false;
+        return eConvOk;
+    }
+    return eConvFormat;
 }
 
 template<>
-unsigned short getValue_as(const char * const val) {
-    return (unsigned short) strtoul(val, NULL, 0);
+eConvResult parseValue(const char * const val, signed char& out) {
+    return parseSignedAs(val, SCHAR_MIN, SCHAR_MAX, out);
 }
 
 template<>
-unsigned char getValue_as(const char * const val) {
-    return (unsigned char) strtoul(val, NULL, 0);
+eConvResult parseValue(const char * const val, unsigned char& out) {
+    return parseUnsignedAs(val, UCHAR_MAX, out);
 }
 
 template<>
-long long getValue_as(const char * const val) {
-    return strtoll(val, NULL, 0);
+eConvResult parseValue(const char * const val, short& out) {
+    return parseSignedAs(val, SHRT_MIN, SHRT_MAX, out);
 }
 
-template<typename C>
-C getValue_as(const char * const val) {
-    C ret;
-    std::istringstream ss(val);
-    ss >> ret;
-    return ret;
+template<>
+eConvResult parseValue(const char * const val, unsigned short& out) {
+    return parseUnsignedAs(val, USHRT_MAX, out);
+}
+
+template<>
+eConvResult parseValue(const char * const val, int& out) {
+    return parseSignedAs(val, INT_MIN, INT_MAX, out);
+}
+
+template<>
+eConvResult parseValue(const char * const val, unsigned int& out) {
+    return parseUnsignedAs(val, UINT_MAX, out);
+}
+
+template<>
+eConvResult parseValue(const char * const val, long& out) {
+    return parseSignedAs(val, LONG_MIN, LONG_MAX, out);
+}
+
+template<>
+eConvResult parseValue(const char * const val, unsigned long& out) {
+    return parseUnsignedAs(val, ULONG_MAX, out);
+}
+
+template<>
+eConvResult parseValue(const char * const val, long long& out) {
+    return parseSignedAs(val, LLONG_MIN, LLONG_MAX, out);
+}
+
+template<>
+eConvResult parseValue(const char * const val, unsigned long long& out) {
+    return parseUnsignedAs(val, ULLONG_MAX, out);
+}
+
+template<>
+eConvResult parseValue(const char * const val, float& out) {
+    return parseDecimal(val, strtof, FLT_MAX, out);
+}
+
+template<>
+eConvResult parseValue(const char * const val, double& out) {
+    return parseDecimal(val, strtod, DBL_MAX, out);
+}
+
+template<>
+size_t formatValue(const String& val, char * const buf, size_t len) {
+    size_t required = val.length();
+    if (required < len) {
+        memcpy(buf, val.c_str(), required + 1);
+    }
+    return required;
+}
+
+template<>
+size_t formatValue(const bool& val, char * const buf, size_t len) {
+    return formatDecimal(val ? 1 : 0, false, buf, len);
+}
+
+template<>
+size_t formatValue(const unsigned short& val, char * const buf, size_t len) {
+    return formatDecimal(val, false, buf, len);
+}
+
+template<>
+size_t formatValue(const unsigned char& val, char * const buf, size_t len) {
+    return formatDecimal(val, false, buf, len);
+}
+
+template<>
+size_t formatValue(const long long& val, char * const buf, size_t len) {
+    return formatSigned(val, buf, len);
+}
+
+template<>
+size_t formatValue(const signed char& val, char * const buf, size_t len) {
+    return formatSigned(val, buf, len);
+}
+
+template<>
+size_t formatValue(const short& val, char * const buf, size_t len) {
+    return formatSigned(val, buf, len);
+}
+
+template<>
+size_t formatValue(const int& val, char * const buf, size_t len) {
+    return formatSigned(val, buf, len);
+}
+
+template<>
+size_t formatValue(const unsigned int& val, char * const buf, size_t len) {
+    return formatDecimal(val, false, buf, len);
+}
+
+template<>
+size_t formatValue(const long& val, char * const buf, size_t len) {
+    return formatSigned(val, buf, len);
+}
+
+template<>
+size_t formatValue(const unsigned long& val, char * const buf, size_t len) {
+    return formatDecimal(val, false, buf, len);
+}
+
+template<>
+size_t formatValue(const unsigned long long& val, char * const buf, size_t len) {
+    return formatDecimal(val, false, buf, len);
+}
+
+// Enough significant digits to read back the same value
+template<>
+size_t formatValue(const float& val, char * const buf, size_t len) {
+    int n = snprintf(buf, len, "%.9g", (double)val);
+    return (n < 0) ? 0 : (size_t)n;
+}
+
+template<>
+size_t formatValue(const double& val, char * const buf, size_t len) {
+    int n = snprintf(buf, len, "%.17g", val);
+    return (n < 0) ? 0 : (size_t)n;
 }
@@ -32,7 +32,6 @@
 //  Includes
 //==============================================================================
 #include <vector>
-#include <sstream>
 #include <globals.h>
 #include <memory>
 
@@ -45,9 +44,45 @@ using namespace std;
 //==============================================================================
 //  Exported types
 //==============================================================================
+typedef enum {
+    eConvOk = 0,
+    eConvFormat,        // Not a valid literal for the target type
+    eConvRange          // Valid number, but out of range for the target type
+} eConvResult;
 
+/**
+ * @brief Parse a string into a value, from_chars style
+ * @param val NUL-terminated input. Leading and trailing whitespace is ignored,
+ *        integers may be decimal or 0x-prefixed hex, floating point values
+ *        decimal or the inf and nan formatValue() prints.
+ * @param out Receives the parsed value, left untouched on error
+ * @return eConvResult - eConvOk, eConvFormat or eConvRange
+ *
+ * No allocations except for the String specialization itself.
+ */
 template<typename C>
-C getValue_as(const char * const val);
+eConvResult parseValue(const char * const val, C& out);
+
+/**
+ * @brief Parse a string into a value, value-initialized C on error
+ */
+template<typename C>
+C getValue_as(const char * const val) {
+    C ret = C();
+    parseValue<C>(val, ret);
+    return ret;
+}
+
+/**
+ * @brief Format a value into a caller-provided buffer without allocating
+ * @param val Value to format
+ * @param buf Destination buffer, NUL-terminated when the value fits
+ * @param len Size of buf in bytes
+ * @return size_t - length of the formatted value excluding the NUL, as snprintf.
+ *         The value fitted if the return is less than len.
+ */
+template<typename C>
+size_t formatValue(const C& val, char * const buf, size_t len);
 
 //==============================================================================
 //  Exported data
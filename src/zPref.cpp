@@ -26,10 +26,14 @@
 //  Includes
 //==============================================================================
 
+#include <algorithm>
+#include <atomic>
+#include <string.h>
 #include "zPref.h"
 #include <logger.h>
 #include "nvs_flash.h"
 #include "nvs.h"
+#include "esp_system.h"
 
 //==============================================================================
 //  Defines
@@ -39,6 +43,16 @@
 //==============================================================================
 //  Local types
 //==============================================================================
+// Shared by the tasks of zPref::InitAll()
+struct zPrefInitContext {
+    zPref * const *     configs;
+    size_t              count;
+    const char *        partition;
+    bool                preload;
+    TaskHandle_t        waiter;
+    std::atomic<size_t> next{0};
+    std::atomic<bool>   failed{false};
+};
 
 //==============================================================================
 //  Local function definitions
@@ -51,6 +65,48 @@
 //==============================================================================
 //  Local functions
 //==============================================================================
+static int hexDigit(char c)
+{
+    if ((c >= '0') && (c <= '9')) return c - '0';
+    if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+    return -1;
+}
+
+static const char hexChars[] = "0123456789abcdef";
+
+// Writes s with backslash, CR and LF escaped so that every value stays on one line
+static size_t printEscaped(Print& out, const char* s, size_t len)
+{
+    size_t written = 0;
+    size_t run = 0;
+    for (size_t i = 0; i < len; i++) {
+        const char* escape = (s[i] == '\\') ? "\\\\" : (s[i] == '\n') ? "\\n" : (s[i] == '\r') ? "\\r" : nullptr;
+        if (escape != nullptr) {
+            written += out.write((const uint8_t*)s + run, i - run);
+            written += out.write((const uint8_t*)escape, 2);
+            run = i + 1;
+        }
+    }
+    written += out.write((const uint8_t*)s + run, len - run);
+    return written;
+}
+
+// Reverses printEscaped in place, returns the new length
+static size_t unescape(char* s, size_t len)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        if ((s[i] == '\\') && (i + 1 < len)) {
+            i++;
+            s[out++] = (s[i] == 'n') ? '\n' : (s[i] == 'r') ? '\r' : s[i];
+        } else {
+            s[out++] = s[i];
+        }
+    }
+    s[out] = '\0';
+    return out;
+}
 
 //==============================================================================
 //  Exported data
@@ -63,73 +119,73 @@
 // NVS get implementations
 bool zPrefBase::nvs_getBool(const char* key, bool default_value) {
     int8_t value;
-    esp_err_t err = nvs_get_i8(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_I8, &value);
     return (err == ESP_OK) ? (bool)value : default_value;
 }
 
 int8_t zPrefBase::nvs_getChar(const char* key, int8_t default_value) {
     int8_t value;
-    esp_err_t err = nvs_get_i8(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_I8, &value);
     return (err == ESP_OK) ? value : default_value;
 }
 
 uint8_t zPrefBase::nvs_getUChar(const char* key, uint8_t default_value) {
     uint8_t value;
-    esp_err_t err = nvs_get_u8(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_U8, &value);
     return (err == ESP_OK) ? value : default_value;
 }
 
 int16_t zPrefBase::nvs_getShort(const char* key, int16_t default_value) {
     int16_t value;
-    esp_err_t err = nvs_get_i16(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_I16, &value);
     return (err == ESP_OK) ? value : default_value;
 }
 
 uint16_t zPrefBase::nvs_getUShort(const char* key, uint16_t default_value) {
     uint16_t value;
-    esp_err_t err = nvs_get_u16(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_U16, &value);
     return (err == ESP_OK) ? value : default_value;
 }
 
 int32_t zPrefBase::nvs_getInt(const char* key, int32_t default_value) {
     int32_t value;
-    esp_err_t err = nvs_get_i32(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_I32, &value);
     return (err == ESP_OK) ? value : default_value;
 }
 
 uint32_t zPrefBase::nvs_getUInt(const char* key, uint32_t default_value) {
     uint32_t value;
-    esp_err_t err = nvs_get_u32(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_U32, &value);
     return (err == ESP_OK) ? value : default_value;
 }
 
 int32_t zPrefBase::nvs_getLong(const char* key, int32_t default_value) {
     int32_t value;
-    esp_err_t err = nvs_get_i32(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_I32, &value);
     return (err == ESP_OK) ? value : default_value;
 }
 
 uint32_t zPrefBase::nvs_getULong(const char* key, uint32_t default_value) {
     uint32_t value;
-    esp_err_t err = nvs_get_u32(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_U32, &value);
     return (err == ESP_OK) ? value : default_value;
 }
 
 int64_t zPrefBase::nvs_getLong64(const char* key, int64_t default_value) {
     int64_t value;
-    esp_err_t err = nvs_get_i64(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_I64, &value);
     return (err == ESP_OK) ? value : default_value;
 }
 
 uint64_t zPrefBase::nvs_getULong64(const char* key, uint64_t default_value) {
     uint64_t value;
-    esp_err_t err = nvs_get_u64(nvs_handle(), key, &value);
+    esp_err_t err = storage().GetValue(key, NVS_TYPE_U64, &value);
     return (err == ESP_OK) ? value : default_value;
 }
 
-String zPrefBase::nvs_getString(const char* key, String default_value) {
+String zPrefBase::nvs_getString(const char* key, const char* default_value) {
     size_t required_size = 0;
-    esp_err_t err = nvs_get_str(nvs_handle(), key, NULL, &required_size);
+    esp_err_t err = storage().Get(key, NVS_TYPE_STR, NULL, &required_size);
     if (err != ESP_OK) {
         return default_value;
     }
@@ -139,7 +195,7 @@ String zPrefBase::nvs_getString(const char* key, String default_value) {
         return default_value;
     }
 
-    err = nvs_get_str(nvs_handle(), key, value, &required_size);
+    err = storage().Get(key, NVS_TYPE_STR, value, &required_size);
     if (err != ESP_OK) {
         free(value);
         return default_value;
@@ -153,150 +209,2194 @@ String zPrefBase::nvs_getString(const char* key, String default_value) {
 // NVS set implementations
 size_t zPrefBase::nvs_putBool(const char* key, bool value) {
     int8_t val = (int8_t)value;
-    esp_err_t err = nvs_set_i8(nvs_handle(), key, val);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_I8, val);
     return (err == ESP_OK) ? 1 : 0;
 }
 
 size_t zPrefBase::nvs_putChar(const char* key, int8_t value) {
-    esp_err_t err = nvs_set_i8(nvs_handle(), key, value);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_I8, value);
     return (err == ESP_OK) ? 1 : 0;
 }
 
 size_t zPrefBase::nvs_putUChar(const char* key, uint8_t value) {
-    esp_err_t err = nvs_set_u8(nvs_handle(), key, value);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_U8, value);
     return (err == ESP_OK) ? 1 : 0;
 }
 
 size_t zPrefBase::nvs_putShort(const char* key, int16_t value) {
-    esp_err_t err = nvs_set_i16(nvs_handle(), key, value);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_I16, value);
     return (err == ESP_OK) ? 1 : 0;
 }
 
 size_t zPrefBase::nvs_putUShort(const char* key, uint16_t value) {
-    esp_err_t err = nvs_set_u16(nvs_handle(), key, value);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_U16, value);
     return (err == ESP_OK) ? 1 : 0;
 }
 
 size_t zPrefBase::nvs_putInt(const char* key, int32_t value) {
-    esp_err_t err = nvs_set_i32(nvs_handle(), key, value);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_I32, value);
     return (err == ESP_OK) ? 1 : 0;
 }
 
 size_t zPrefBase::nvs_putUInt(const char* key, uint32_t value) {
-    esp_err_t err = nvs_set_u32(nvs_handle(), key, value);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_U32, value);
     return (err == ESP_OK) ? 1 : 0;
 }
 
 size_t zPrefBase::nvs_putLong(const char* key, int32_t value) {
-    esp_err_t err = nvs_set_i32(nvs_handle(), key, value);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_I32, value);
     return (err == ESP_OK) ? 1 : 0;
 }
 
 size_t zPrefBase::nvs_putULong(const char* key, uint32_t value) {
-    esp_err_t err = nvs_set_u32(nvs_handle(), key, value);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_U32, value);
     return (err == ESP_OK) ? 1 : 0;
 }
 
 size_t zPrefBase::nvs_putLong64(const char* key, int64_t value) {
-    esp_err_t err = nvs_set_i64(nvs_handle(), key, value);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_I64, value);
     return (err == ESP_OK) ? 1 : 0;
 }
 
 size_t zPrefBase::nvs_putULong64(const char* key, uint64_t value) {
-    esp_err_t err = nvs_set_u64(nvs_handle(), key, value);
+    esp_err_t err = storage().SetValue(key, NVS_TYPE_U64, value);
     return (err == ESP_OK) ? 1 : 0;
 }
 
-size_t zPrefBase::nvs_putString(const char* key, String value) {
-    esp_err_t err = nvs_set_str(nvs_handle(), key, value.c_str());
+size_t zPrefBase::nvs_putString(const char* key, const String& value) {
+    esp_err_t err = storage().Set(key, NVS_TYPE_STR, value.c_str(), value.length() + 1);
     return (err == ESP_OK) ? value.length() : 0;
 }
 
+size_t zPrefBase::nvs_getBlob(const char* key, void* buf, size_t len) {
+    size_t required_size = 0;
+    esp_err_t err = storage().Get(key, NVS_TYPE_BLOB, NULL, &required_size);
+    if ((err != ESP_OK) || (required_size > len)) {
+        return 0;
+    }
+    err = storage().Get(key, NVS_TYPE_BLOB, buf, &required_size);
+    return (err == ESP_OK) ? required_size : 0;
+}
+
+size_t zPrefBase::nvs_putBlob(const char* key, const void* buf, size_t len) {
+    esp_err_t err = storage().Set(key, NVS_TYPE_BLOB, buf, len);
+    return (err == ESP_OK) ? len : 0;
+}
+
 //==============================================================================
 //  Exported functions
 //==============================================================================
 void zPrefBase::commit()
 {
+    if (_batchDepth > 0) {
+        // Deferred to CommitBatch()
+        _commitPending = true;
+        return;
+    }
+
     LOG(eLogDebug, "Committing NVS changes");
     // Commit any pending changes to NVS
-    esp_err_t err = nvs_commit(nvs_handle());
+    ZPREF_TIMESTAMP(start);
+    esp_err_t err = storage(0).Commit();
+    for (uint8_t shard = 1; _writtenShards >> shard; shard++) {
+        if (_writtenShards & (1u << shard)) {
+            esp_err_t shardErr = storage(shard).Commit();
+            err = (err != ESP_OK) ? err : shardErr;
+        }
+    }
+    _writtenShards = 0;
+    ZPREF_RECORD(_timing.commit, start);
     if (err != ESP_OK) {
         LOG(eLogWarn, "Error committing NVS changes: %s", esp_err_to_name(err));
     }
+#if ZPREF_ENABLE_WEAR_STATS
+    _wear.commits++;
+    for (auto var : _uncommittedVariables) {
+        var->_wear.commits++;
+        var->_uncommitted = false;
+    }
+    _uncommittedVariables.clear();
+#endif
+}
+
+#if ZPREF_ENABLE_WEAR_STATS
+void zPrefBase::countWrite(zPrefVariableBase* var, size_t bytes)
+{
+    var->_wear.writes++;
+    var->_wear.bytes += bytes;
+    _wear.writes++;
+    _wear.bytes += bytes;
+    if (!var->_uncommitted) {
+        var->_uncommitted = true;
+        _uncommittedVariables.push_back(var);
+    }
+}
+
+void zPrefBase::countSkipped(zPrefVariableBase* var)
+{
+    ZPREF_LOCK_STORAGE(*this);  // Counted by Set() with only the write lock
+    var->_wear.skipped++;
+    _wear.skipped++;
 }
+#endif
 
 //==============================================================================
-//  zPref class implementation
+//  Variable registry
 //==============================================================================
+void zPrefBase::buildIndex()
+{
+    _registry = registry();
+    const zPrefRegistry& r = _registry;
+    for (size_t i = 0; i < r.count; i++) {
+        r.index[i] = i;
+    }
+    std::sort(r.index, r.index + r.count, [&r](uint16_t a, uint16_t b) {
+        return strcmp(r.variables[a]->_key, r.variables[b]->_key) < 0;
+    });
+    if (r.hashIndex != nullptr) {
+        for (size_t i = 0; i < r.count; i++) {
+            r.hashIndex[i] = i;
+        }
+        std::sort(r.hashIndex, r.hashIndex + r.count, [&r](uint16_t a, uint16_t b) {
+            return zPrefHash(r.variables[a]->_key) < zPrefHash(r.variables[b]->_key);
+        });
+        for (size_t i = 1; i < r.count; i++) {
+            if (zPrefHash(r.variables[r.hashIndex[i - 1]]->_key) == zPrefHash(r.variables[r.hashIndex[i]]->_key)) {
+                LOG(eLogError, "Keys %s and %s have the same hash, deltas cannot tell them apart",
+                    r.variables[r.hashIndex[i - 1]]->_key, r.variables[r.hashIndex[i]]->_key);
+            }
+        }
+    }
+    _indexed = true;
+}
 
-eStatus zPref::Init(const char* partition_name) {
-    eStatus retVal = eOK;
-    status = eINPROGRESS;
-    _partition_name = partition_name;
-    LOG(eLogInfo, "Initializing NVS partition: %s, namespace: %s", _partition_name, _namespace);
+zPrefVariableBase* zPrefBase::Find(const char * const key)
+{
+    const zPrefRegistry& r = Registry();
+    const uint16_t* end = r.index + r.count;
+    const uint16_t* pos = std::lower_bound((const uint16_t*)r.index, end, key, [&r](uint16_t i, const char* k) {
+        return strcmp(r.variables[i]->_key, k) < 0;
+    });
+    if ((pos != end) && (strcmp(r.variables[*pos]->_key, key) == 0)) {
+        return r.variables[*pos];
+    }
+    return nullptr;
+}
 
-    // Initialize NVS flash partition
-    esp_err_t err = nvs_flash_init_partition(_partition_name);
-    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        LOG(eLogWarn, "NVS partition needs erasing, erasing partition %s", _partition_name);
-        ESP_ERROR_CHECK(nvs_flash_erase_partition(_partition_name));
-        err = nvs_flash_init_partition(_partition_name);
+zPrefVariableBase* zPrefBase::FindHash(uint32_t hash)
+{
+    const zPrefRegistry& r = Registry();
+    if (r.hashIndex == nullptr) {
+        // Registry without a hash index - scan
+        for (size_t i = 0; i < r.count; i++) {
+            if (zPrefHash(r.variables[i]->_key) == hash) {
+                return r.variables[i];
+            }
+        }
+        return nullptr;
     }
+    const uint16_t* end = r.hashIndex + r.count;
+    const uint16_t* pos = std::lower_bound((const uint16_t*)r.hashIndex, end, hash, [&r](uint16_t i, uint32_t h) {
+        return zPrefHash(r.variables[i]->_key) < h;
+    });
+    if ((pos != end) && (zPrefHash(r.variables[*pos]->_key) == hash)) {
+        return r.variables[*pos];
+    }
+    return nullptr;
+}
 
-    if (err != ESP_OK) {
-        LOG(eLogWarn, "Error initializing NVS flash partition %s: %s", _partition_name, esp_err_to_name(err));
-        retVal = eFAILED;
-    } else {
-        // Open NVS handle with the specified partition
-        err = nvs_open_from_partition(_partition_name, _namespace, NVS_READWRITE, &_nvs_handle);
-        if (err != ESP_OK) {
-            LOG(eLogWarn, "Error opening NVS namespace %s in partition %s: %s",
-                _namespace, _partition_name, esp_err_to_name(err));
-            retVal = eFAILED;
+// Glob match of the whole key, * matches any run of characters, ? one character
+static bool globMatch(const char* pattern, const char* key)
+{
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (*key != '\0') {
+        if ((*pattern == '?') || ((*pattern != '*') && (*pattern == *key))) {
+            pattern++;
+            key++;
+        } else if (*pattern == '*') {
+            star = pattern++;
+            resume = key;
+        } else if (star != nullptr) {
+            pattern = star + 1;     // Let the last * absorb one more character
+            key = ++resume;
         } else {
-            // Read stored configuration version
-            uint32_t storedVersion = nvs_getULong(CONFIG_VERSION_KEY, 0);
+            return false;
+        }
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
 
-            // Check if migration is needed
-            if (storedVersion != _currentVersion) {
-                LOG(eLogInfo, "Configuration version mismatch: stored=%d, current=%d",
-                    storedVersion, _currentVersion);
+//==============================================================================
+//  Queries
+//==============================================================================
+zPrefQuery::zPrefQuery(zPrefBase& config, const char * const pattern) :
+    _config(config),
+    _pattern(((pattern != nullptr) && (strcmp(pattern, "*") != 0)) ? pattern : nullptr)
+{
+    const zPrefRegistry& r = _config.Registry();
+    _pos = r.index;
+    _end = r.index + r.count;
+    _prefixLen = 0;
+    _glob = false;
+    if (_pattern == nullptr) {
+        return;
+    }
 
-                // Call user's initialization/migration hook
-                retVal = OnInit(storedVersion, _currentVersion);
+    _prefixLen = strcspn(_pattern, "*?");
+    _glob = _pattern[_prefixLen] != '\0';
 
-                // If migration was successful, update the stored version
-                if (retVal == eOK) {
-                    nvs_putULong(CONFIG_VERSION_KEY, _currentVersion);
-                    commit();
-                    LOG(eLogInfo, "Configuration version updated to %d", _currentVersion);
-                }
+    // First key not ordered before the literal prefix
+    const char* prefix = _pattern;
+    size_t prefixLen = _prefixLen;
+    _pos = std::lower_bound(_pos, _end, prefix, [&r, prefixLen](uint16_t i, const char* p) {
+        return strncmp(r.variables[i]->_key, p, prefixLen) < 0;
+    });
+    advance(false);
+}
+
+// Moves _pos to the next matching key, the prefix range ends at the first key without it
+void zPrefQuery::advance(bool skipCurrent)
+{
+    if (skipCurrent && (_pos != _end)) {
+        _pos++;
+    }
+    if (_pattern == nullptr) {
+        return;
+    }
+    const zPrefRegistry& r = _config.Registry();
+    for (; _pos != _end; _pos++) {
+        const char* key = r.variables[*_pos]->_key;
+        if (strncmp(key, _pattern, _prefixLen) != 0) {
+            _pos = _end;
+            break;
+        }
+        if (_glob ? globMatch(_pattern + _prefixLen, key + _prefixLen) : (key[_prefixLen] == '\0')) {
+            break;
+        }
+    }
+}
+
+zPrefVariableBase* zPrefQuery::Next()
+{
+    if (_pos == _end) {
+        return nullptr;
+    }
+    zPrefVariableBase* var = _config.Registry().variables[*_pos];
+    advance(true);
+    return var;
+}
+
+// Print into a fixed buffer, remembers whether anything was cut off
+class zPrefBufferWriter : public Print {
+    private:
+        char * const    _buf;
+        const size_t    _len;
+
+    public:
+        size_t pos = 0;
+        bool overflow = false;
+
+        zPrefBufferWriter(char * const buf, size_t len) : _buf(buf), _len(len) {};
+
+        using Print::write;
+
+        size_t write(uint8_t c) {
+            if (pos >= _len) {
+                overflow = true;
+                return 0;
+            }
+            _buf[pos++] = (char)c;
+            return 1;
+        };
+};
+
+size_t zPrefQuery::Read(char * const buf, size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+    char scratch[ZPREF_LINE_MAX];
+    size_t pos = 0;
+    while (_pos != _end) {
+        zPrefVariableBase* var = _config.Registry().variables[*_pos];
+        zPrefBufferWriter line(buf + pos, len - 1 - pos);
+        line.write((const uint8_t*)var->_key, strlen(var->_key));
+        line.write((uint8_t)'=');
+        var->ExportValue(line, scratch, sizeof(scratch));
+        line.write((uint8_t)'\n');
+        if (line.overflow && (pos > 0)) {
+            break;      // Continued by the next Read()
+        }
+        pos += line.pos;
+        advance(true);
+        if (line.overflow) {
+            break;      // Truncated, longer than the whole buffer
+        }
+    }
+    buf[pos] = '\0';
+    return pos;
+}
+
+size_t zPrefBase::ForEach(const char * const pattern, zPrefVisitor fn, void * ctx)
+{
+    zPrefQuery query(*this, pattern);
+    size_t count = 0;
+    while (zPrefVariableBase* var = query.Next()) {
+        count++;
+        if (!fn(*var, ctx)) {
+            break;
+        }
+    }
+    return count;
+}
+
+size_t zPrefBase::Export(Print& out, const char * const pattern)
+{
+    ZPREF_LOCK_WRITES(*this);
+    char scratch[ZPREF_LINE_MAX];
+    zPrefQuery query(*this, pattern);
+    size_t count = 0;
+    while (zPrefVariableBase* var = query.Next()) {
+        out.write((const uint8_t*)var->_key, strlen(var->_key));
+        out.write((uint8_t)'=');
+        var->ExportValue(out, scratch, sizeof(scratch));
+        out.write((uint8_t)'\n');
+        count++;
+    }
+    return count;
+}
+
+//==============================================================================
+//  Export and import
+//==============================================================================
+size_t zPrefVariableBase::ExportValue(Print& out, char * const scratch, size_t len)
+{
+    if (GetString(scratch, len)) {
+        return printEscaped(out, scratch, strlen(scratch));
+    }
+    // Rare - a String value longer than the scratch buffer
+    String value = GetString();
+    return printEscaped(out, value.c_str(), value.length());
+}
+
+size_t zPrefBase::Export(Print& out)
+{
+    ZPREF_LOCK_WRITES(*this);
+    char scratch[ZPREF_LINE_MAX];
+    size_t count = VariableCount();
+    for (size_t i = 0; i < count; i++) {
+        zPrefVariableBase* var = Variable(i);
+        out.write((const uint8_t*)var->_key, strlen(var->_key));
+        out.write((uint8_t)'=');
+        var->ExportValue(out, scratch, sizeof(scratch));
+        out.write((uint8_t)'\n');
+    }
+    return count;
+}
+
+size_t zPrefBase::Import(Stream& in)
+{
+    char line[ZPREF_LINE_MAX];
+    size_t count = 0;
+
+    zPrefBatch batch(*this);
+    while (true) {
+        size_t len = in.readBytesUntil('\n', line, sizeof(line) - 1);
+        if ((len == 0) && (in.peek() < 0)) {
+            break;
+        }
+        if (len == sizeof(line) - 1) {
+            // Too long to hold - drop the rest of the line
+            LOG(eLogWarn, "Import line longer than %d bytes skipped", (int)(sizeof(line) - 2));
+            while (in.readBytesUntil('\n', line, sizeof(line) - 1) == sizeof(line) - 1) {}
+            continue;
+        }
+        if ((len > 0) && (line[len - 1] == '\r')) {
+            len--;
+        }
+        line[len] = '\0';
+        if (importLine(line)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Applies one key=value line in place, false for comments and skipped lines
+bool zPrefBase::importLine(char* line)
+{
+    if ((line[0] == '\0') || (line[0] == '#')) {
+        return false;
+    }
+
+    char* value = strchr(line, '=');
+    if (value == nullptr) {
+        LOG(eLogWarn, "Import line without '=' skipped");
+        return false;
+    }
+    *value++ = '\0';
+    unescape(value, strlen(value));
+
+    zPrefVariableBase* var = Find(line);
+    if (var == nullptr) {
+        LOG(eLogWarn, "Import of unknown variable %s skipped", line);
+        return false;
+    }
+    if ((var->FromString(value) == 0) && (*value != '\0')) {
+        LOG(eLogWarn, "Import of %s failed", line);
+        return false;
+    }
+    return true;
+}
+
+//==============================================================================
+//  Config deltas
+//==============================================================================
+static void putLE(uint8_t* buf, uint32_t val, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++) {
+        buf[i] = (uint8_t)(val >> (8 * i));
+    }
+}
+
+static uint32_t getLE(const uint8_t* buf, size_t bytes)
+{
+    uint32_t val = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        val |= (uint32_t)buf[i] << (8 * i);
+    }
+    return val;
+}
+
+static uint32_t deltaChecksum(const uint8_t* buf, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ buf[i]) * 16777619u;
+    }
+    return h;
+}
+
+size_t zPrefBase::ComputeDelta(uint32_t since, uint8_t * const buf, size_t len)
+{
+    ZPREF_LOCK_WRITES(*this);
+    size_t pos = ZPREF_DELTA_HEADER_SIZE;
+    size_t count = 0;
+    size_t variables = VariableCount();
+    for (size_t i = 0; i < variables; i++) {
+        zPrefVariableBase* var = Variable(i);
+        if (var->_changeSeq <= since) {
+            continue;
+        }
+        // Size first, the value is only encoded when the whole entry fits
+        size_t size = var->Encode(nullptr, 0);
+        if ((size > UINT16_MAX) || (count == UINT16_MAX)) {
+            LOG(eLogWarn, "Variable %s does not fit a delta entry, skipped", var->_key);
+            continue;
+        }
+        if (pos + ZPREF_DELTA_ENTRY_SIZE + size <= len) {
+            putLE(buf + pos, zPrefHash(var->_key), 4);
+            buf[pos + 4] = var->Kind();
+            putLE(buf + pos + 5, size, 2);
+            if (var->Encode(buf + pos + ZPREF_DELTA_ENTRY_SIZE, size) != size) {
+                return 0;   // Changed size while encoding - only possible without the write lock
+            }
+        }
+        pos += ZPREF_DELTA_ENTRY_SIZE + size;
+        count++;
+    }
+
+    size_t total = pos + ZPREF_DELTA_TRAILER_SIZE;
+    if (total <= len) {
+        putLE(buf, ZPREF_DELTA_MAGIC, 2);
+        buf[2] = ZPREF_DELTA_VERSION;
+        buf[3] = 0;
+        putLE(buf + 4, count, 2);
+        putLE(buf + 6, _changeSequence, 4);
+        putLE(buf + pos, deltaChecksum(buf, pos), 4);
+    }
+    return total;
+}
+
+eStatus zPrefBase::ApplyDelta(const uint8_t * const buf, size_t len)
+{
+    if ((buf == nullptr) || (len < ZPREF_DELTA_HEADER_SIZE + ZPREF_DELTA_TRAILER_SIZE)) {
+        LOG(eLogWarn, "Delta of %d bytes is too short", (int)len);
+        return eFAILED;
+    }
+    size_t end = len - ZPREF_DELTA_TRAILER_SIZE;
+    if ((getLE(buf, 2) != ZPREF_DELTA_MAGIC) || (buf[2] != ZPREF_DELTA_VERSION)) {
+        LOG(eLogWarn, "Not a version %d delta", ZPREF_DELTA_VERSION);
+        return eFAILED;
+    }
+    if (getLE(buf + end, 4) != deltaChecksum(buf, end)) {
+        LOG(eLogWarn, "Delta checksum mismatch");
+        return eFAILED;
+    }
+
+    // Validate every entry before touching any variable
+    size_t count = getLE(buf + 4, 2);
+    size_t pos = ZPREF_DELTA_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        if (pos + ZPREF_DELTA_ENTRY_SIZE > end) {
+            LOG(eLogWarn, "Delta truncated at entry %d", (int)i);
+            return eFAILED;
+        }
+        uint32_t hash = getLE(buf + pos, 4);
+        size_t size = getLE(buf + pos + 5, 2);
+        const uint8_t* value = buf + pos + ZPREF_DELTA_ENTRY_SIZE;
+        if (pos + ZPREF_DELTA_ENTRY_SIZE + size > end) {
+            LOG(eLogWarn, "Delta truncated at entry %d", (int)i);
+            return eFAILED;
+        }
+        zPrefVariableBase* var = FindHash(hash);
+        if (var == nullptr) {
+            LOG(eLogWarn, "Delta entry for unknown key hash %08x", (unsigned)hash);
+            return eFAILED;
+        }
+        if ((var->Kind() != buf[pos + 4]) || !var->Accepts(value, size)) {
+            LOG(eLogWarn, "Delta entry for %s does not fit the variable", var->_key);
+            return eFAILED;
+        }
+        pos += ZPREF_DELTA_ENTRY_SIZE + size;
+    }
+    if (pos != end) {
+        LOG(eLogWarn, "Delta has %d trailing bytes", (int)(end - pos));
+        return eFAILED;
+    }
+
+    BeginBatch();
+    pos = ZPREF_DELTA_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        size_t size = getLE(buf + pos + 5, 2);
+        zPrefVariableBase* var = FindHash(getLE(buf + pos, 4));
+        if ((var->Assign(buf + pos + ZPREF_DELTA_ENTRY_SIZE, size) == 0) && (size != 0)) {
+            LOG(eLogWarn, "Delta entry for %s not applied, aborting", var->_key);
+            AbortBatch();
+            return eFAILED;
+        }
+        pos += ZPREF_DELTA_ENTRY_SIZE + size;
+    }
+    CommitBatch();
+    LOG(eLogDebug, "Applied delta of %d variables", (int)count);
+    return eOK;
+}
+
+//==============================================================================
+//  Change notification
+//==============================================================================
+eStatus zPrefBase::Subscribe(const char * const key, zPrefObserver fn, void * ctx)
+{
+    if ((key == nullptr) || (strcmp(key, "*") == 0)) {
+        return Subscribe((zPrefVariableBase*)nullptr, fn, ctx);
+    }
+
+    zPrefVariableBase* var = Find(key);
+    if (var == nullptr) {
+        LOG(eLogWarn, "Cannot subscribe to unknown variable %s", key);
+        return eFAILED;
+    }
+    return Subscribe(var, fn, ctx);
+}
+
+eStatus zPrefBase::Subscribe(zPrefVariableBase * var, zPrefObserver fn, void * ctx)
+{
+    if (fn == nullptr) {
+        return eFAILED;
+    }
+    ZPREF_LOCK_WRITES(*this);
+    _subscriptions.push_back(zPrefSubscription{ var, fn, ctx });
+    return eOK;
+}
+
+void zPrefBase::Unsubscribe(zPrefObserver fn, void * ctx)
+{
+    ZPREF_LOCK_WRITES(*this);
+    _subscriptions.erase(std::remove_if(_subscriptions.begin(), _subscriptions.end(),
+        [fn, ctx](const zPrefSubscription& s) { return (s.fn == fn) && (s.ctx == ctx); }),
+        _subscriptions.end());
+}
+
+void zPrefBase::notify(zPrefVariableBase* var)
+{
+    var->_changeSeq = ++_changeSequence;
+    for (const auto& s : _subscriptions) {
+        if ((s.var == nullptr) || (s.var == var)) {
+            s.fn(*var, s.ctx);
+        }
+    }
+}
+
+//==============================================================================
+//  Cache policies
+//==============================================================================
+eStatus zPrefBase::SetCachePolicy(zPrefVariableBase * var, eZPrefCachePolicy policy)
+{
+    zPrefCacheState* state = (var != nullptr) ? var->CacheState() : nullptr;
+    if (state == nullptr) {
+        LOG(eLogWarn, "Cache policies apply to String variables only");
+        return eFAILED;
+    }
+    ZPREF_LOCK_WRITES(*this);
+    cacheUnlink(var);
+    if (_readThrough == var) {
+        _readThrough = nullptr;
+    }
+    state->_cachePolicy = policy;
+    if (var->initialized) {
+        cacheUsed(var);     // Account the value already loaded
+    }
+    return eOK;
+}
+
+void zPrefBase::SetCachePolicy(eZPrefCachePolicy policy)
+{
+    for (size_t i = 0; i < VariableCount(); i++) {
+        if (Variable(i)->CacheState() != nullptr) {
+            SetCachePolicy(Variable(i), policy);
+        }
+    }
+}
+
+void zPrefBase::SetCacheBudget(size_t bytes)
+{
+    ZPREF_LOCK_WRITES(*this);
+    _cacheBudget = bytes;
+    trimCache(_lruHead);
+}
+
+void zPrefBase::cacheUsed(zPrefVariableBase* var)
+{
+    zPrefCacheState* state = var->CacheState();
+    switch (state->_cachePolicy) {
+        case eZPrefCacheNone:
+            if ((_readThrough != nullptr) && (_readThrough != var)) {
+                _readThrough->Evict();
+            }
+            _readThrough = var;
+            break;
+
+        case eZPrefCacheLru:
+            // Move to the front, measured again - the value may have changed
+            cacheUnlink(var);
+            state->_cachedBytes = var->HeapBytes();
+            _cacheUsed += state->_cachedBytes;
+            state->_lruNext = _lruHead;
+            if (_lruHead != nullptr) {
+                _lruHead->CacheState()->_lruPrev = var;
             } else {
-                // Versions match, just call OnInit with matching versions
-                retVal = OnInit(storedVersion, _currentVersion);
+                _lruTail = var;
             }
+            _lruHead = var;
+            trimCache(var);
+            break;
+
+        default:
+            break;
+    }
+}
+
+void zPrefBase::cacheUnlink(zPrefVariableBase* var)
+{
+    zPrefCacheState* state = var->CacheState();
+    if ((state->_lruPrev == nullptr) && (_lruHead != var)) {
+        return;     // Not in the list
+    }
+    if (state->_lruPrev != nullptr) {
+        state->_lruPrev->CacheState()->_lruNext = state->_lruNext;
+    } else {
+        _lruHead = state->_lruNext;
+    }
+    if (state->_lruNext != nullptr) {
+        state->_lruNext->CacheState()->_lruPrev = state->_lruPrev;
+    } else {
+        _lruTail = state->_lruPrev;
+    }
+    state->_lruPrev = nullptr;
+    state->_lruNext = nullptr;
+    _cacheUsed -= state->_cachedBytes;
+    state->_cachedBytes = 0;
+}
+
+void zPrefBase::trimCache(zPrefVariableBase* keep)
+{
+    zPrefVariableBase* var = _lruTail;
+    while ((_cacheUsed > _cacheBudget) && (var != nullptr)) {
+        zPrefVariableBase* prev = var->CacheState()->_lruPrev;
+        // Staged and queued values cannot be reloaded from NVS yet
+        if ((var != keep) && var->Evict()) {
+            LOG(eLogDebug, "Released cached value of %s", var->_key);
+            cacheUnlink(var);
         }
+        var = prev;
     }
+}
 
-    status = (retVal == eOK) ? eOK : eFAILED;
-    return retVal;
+//==============================================================================
+//  Arena
+//==============================================================================
+zPrefBase::~zPrefBase()
+{
+    if (_arenaOwned) {
+        free(_arena);
+    }
 }
 
-eStatus zPref::Reset() {
-    LOG(eLogInfo, "Reset called - override this method to reset your variables");
+eStatus zPrefBase::SetArena(void * buffer, size_t size)
+{
+    if (_arenaUsed > 0) {
+        LOG(eLogWarn, "Arena already bound, call SetArena() before Init()");
+        return eFAILED;
+    }
+    if (_arenaOwned) {
+        free(_arena);
+        _arenaOwned = false;
+    }
+    _arena = (uint8_t*)buffer;
+    _arenaCapacity = size;
     return eOK;
 }
 
-eStatus zPref::OnInit(uint32_t storedVersion, uint32_t currentVersion) {
+eStatus zPrefBase::bindArena()
+{
+    if (_arenaUsed > 0) {
+        // Bound by an earlier Init()
+        return eOK;
+    }
+
+    size_t required = 0;
+    for (size_t i = 0; i < VariableCount(); i++) {
+        required += Variable(i)->ArenaSize();
+    }
+    if (required == 0) {
+        return eOK;
+    }
+
+    if (_arena == nullptr) {
+        _arena = (uint8_t*)malloc(required);
+        if (_arena == nullptr) {
+            LOG(eLogError, "Failed to allocate %d byte arena", (int)required);
+            return eFAILED;
+        }
+        _arenaCapacity = required;
+        _arenaOwned = true;
+    } else if (_arenaCapacity < required) {
+        LOG(eLogError, "Arena of %d bytes too small, %d required", (int)_arenaCapacity, (int)required);
+        return eFAILED;
+    }
+
+    // Fixed slots in declaration order - values are replaced in place, never reallocated
+    for (size_t i = 0; i < VariableCount(); i++) {
+        zPrefVariableBase* var = Variable(i);
+        size_t size = var->ArenaSize();
+        if (size > 0) {
+            var->BindArena(_arena + _arenaUsed);
+            _arenaUsed += size;
+        }
+    }
+    LOG(eLogDebug, "Arena bound, %d of %d bytes used", (int)_arenaUsed, (int)_arenaCapacity);
+    return eOK;
+}
+
+void zPrefBase::arenaResize(size_t from, size_t to)
+{
+    _arenaInUse = _arenaInUse - from + to;
+    _arenaHighWater = std::max(_arenaHighWater, _arenaInUse);
+}
+
+//==============================================================================
+//  Batch writes
+//==============================================================================
+void zPrefBase::stage(zPrefVariableBase* var)
+{
+    var->_staged = true;
+    _stagedVariables.push_back(var);
+}
+
+void zPrefBase::BeginBatch()
+{
+#if ZPREF_THREAD_SAFE
+    // Held until the matching CommitBatch()/AbortBatch() - other writers and Flush() wait for the batch
+    _writeLock.lock();
+    _storageLock.lock();
+#endif
+    _batchDepth++;
+}
+
+size_t zPrefBase::CommitBatch()
+{
+    ZPREF_LOCK_WRITES(*this);
+    if (_batchDepth == 0) {
+        LOG(eLogWarn, "CommitBatch called without BeginBatch");
+        return 0;
+    }
+
+#if ZPREF_THREAD_SAFE
+    _storageLock.unlock();  // Taken in BeginBatch(), still held by the guard above
+    _writeLock.unlock();
+#endif
+    if (--_batchDepth > 0) {
+        // Nested batch - the outermost CommitBatch writes
+        return 0;
+    }
+
+    if (_writeBehind) {
+        // Hand the batch over to the write-behind task, it commits once for everything
+        for (auto var : _stagedVariables) {
+            var->_staged = false;
+            markDirty(var);
+            notify(var);
+        }
+        _stagedVariables.clear();
+        if (_commitPending) {
+            _commitPending = false;
+            commit();
+        }
+        return 0;
+    }
+
+    // Intent first - replayed by Init() if the writes below are interrupted
+    bool journaled = _journaled && writeJournal();
+
+    size_t written = 0;
+    for (auto var : _stagedVariables) {
+        size_t ret = var->Persist();
+        if (ret == 0) {
+            LOG(eLogWarn, "Error writing staged variable %s", var->_key);
+        }
+        written += ret;
+        var->_staged = false;
+    }
+    batchPersisted();
+
+    if (!_stagedVariables.empty() || _commitPending) {
+        LOG(eLogDebug, "Committing batch of %d variables", (int)_stagedVariables.size());
+        _commitPending = false;
+        commit();
+    }
+    if (journaled) {
+        storage(0).Erase(ZPREF_JOURNAL_KEY);
+        commit();
+    }
+
+    // Once per variable, however often it was set in the batch
+    for (auto var : _stagedVariables) {
+        notify(var);
+    }
+    _stagedVariables.clear();
+
+    return written;
+}
+
+// Collects the journal before it is written as one blob, stops buffering past ZPREF_JOURNAL_MAX
+class zPrefJournalWriter : public Print {
+    public:
+        std::vector<uint8_t> data;
+        size_t length = 0;
+
+        size_t write(uint8_t c) { return write(&c, 1); };
+        size_t write(const uint8_t * buf, size_t len) {
+            length += len;
+            if (length <= ZPREF_JOURNAL_MAX) {
+                data.insert(data.end(), buf, buf + len);
+            }
+            return len;
+        };
+};
+
+bool zPrefBase::writeJournal()
+{
+    zPrefJournalWriter journal;
+    char scratch[ZPREF_LINE_MAX];
+    size_t records = journalRecords(journal);
+    for (auto var : _stagedVariables) {
+        journal.write((const uint8_t*)var->_key, strlen(var->_key));
+        journal.write((uint8_t)'=');
+        var->ExportValue(journal, scratch, sizeof(scratch));
+        journal.write((uint8_t)'\n');
+        records++;
+    }
+    if (records < 2) {
+        return false;   // A single key write is atomic on its own
+    }
+    if (journal.length > ZPREF_JOURNAL_MAX) {
+        LOG(eLogWarn, "Batch journal of %d bytes exceeds %d, committing without it",
+            (int)journal.length, (int)ZPREF_JOURNAL_MAX);
+        return false;
+    }
+
+    esp_err_t err = storage(0).Set(ZPREF_JOURNAL_KEY, NVS_TYPE_BLOB, journal.data.data(), journal.data.size());
+    if (err != ESP_OK) {
+        LOG(eLogWarn, "Error writing batch journal: %s, committing without it", esp_err_to_name(err));
+        return false;
+    }
+    commit();
+    return true;
+}
+
+void zPrefBase::AbortBatch()
+{
+    ZPREF_LOCK_WRITES(*this);
+    LOG(eLogDebug, "Aborting batch of %d variables", (int)_stagedVariables.size());
+    for (auto var : _stagedVariables) {
+        var->Rollback();
+        var->_staged = false;
+    }
+    _stagedVariables.clear();
+    _commitPending = false;
+#if ZPREF_THREAD_SAFE
+    for (; _batchDepth > 0; _batchDepth--) {
+        _storageLock.unlock();  // Every BeginBatch() level
+        _writeLock.unlock();
+    }
+#else
+    _batchDepth = 0;
+#endif
+}
+
+//==============================================================================
+//  Write-behind
+//==============================================================================
+void zPrefBase::markDirty(zPrefVariableBase* var)
+{
+    if (var->_dirty) {
+        // Already queued - coalesced with the pending write
+        return;
+    }
+
+    if (_writeBehind && (_dirtyVariables.size() >= _dirtyCapacity)) {
+        LOG(eLogDebug, "Write-behind queue full, flushing synchronously");
+        Flush();
+    }
+
+    var->_dirty = true;
+    _dirtyVariables.push_back(var);
+    writeBehindNotify();
+}
+
+void zPrefBase::clearDirty(zPrefVariableBase* var)
+{
+    _dirtyVariables.erase(std::remove(_dirtyVariables.begin(), _dirtyVariables.end(), var), _dirtyVariables.end());
+    var->_dirty = false;
+}
+
+size_t zPrefBase::Flush()
+{
+    // Take the queues under the write lock only - Set() keeps queueing while they are written
+    std::vector<zPrefVariableBase*> dirty;
+    std::vector<zPrefVariableBase*> counters;
+    {
+        ZPREF_LOCK_STATE(*this);
+        if (_dirtyVariables.empty() && _pendingCounters.empty()) {
+            return 0;
+        }
+        dirty.swap(_dirtyVariables);
+        counters.swap(_pendingCounters);
+        for (auto var : dirty) {
+            var->_dirty = false;
+            if (var->_group != nullptr) {
+                var->_group->Prepare();
+            }
+        }
+    }
+
+    // Written from the cached values - a Set() meanwhile queues the variable again.
+    // Batches hold the storage lock until they end, so no staged value is written here
+    size_t written = 0;
+    size_t persisted = 0;
+    {
+        ZPREF_LOCK_STORAGE(*this);
+        LOG(eLogDebug, "Flushing %d queued variables and %d counters", (int)dirty.size(), (int)counters.size());
+        for (auto var : dirty) {
+            size_t ret = var->Persist();
+            if (ret == 0) {
+                LOG(eLogWarn, "Error writing queued variable %s", var->_key);
+            }
+            written += ret;
+        }
+        for (auto var : counters) {
+            size_t ret = var->Persist();
+            if (ret != 0) {
+                counters[persisted++] = var;
+            }
+            written += ret;
+        }
+        commit();
+    }
+
+    // Counters notify once written; the emptied queue is handed back to keep its capacity
+    ZPREF_LOCK_STATE(*this);
+    for (size_t i = 0; i < persisted; i++) {
+        notify(counters[i]);
+    }
+    if (_dirtyVariables.empty()) {
+        dirty.clear();
+        _dirtyVariables.swap(dirty);
+    }
+    return written;
+}
+
+//==============================================================================
+//  Counters
+//==============================================================================
+// Key of a counter slot - the variable key and a hex digit, checkCounterKeys() made sure it fits
+static void counterSlotKey(char* out, const char* key, uint8_t slot)
+{
+    size_t len = strlen(key);
+    memcpy(out, key, len);
+    out[len] = hexChars[slot & 0x0F];
+    out[len + 1] = '\0';
+}
+
+// Slot keys must be unique - a longer key or a variable named like a slot would share NVS entries
+eStatus zPrefBase::checkCounterKeys()
+{
+    eStatus ret = eOK;
+    for (size_t i = 0; i < VariableCount(); i++) {
+        zPrefVariableBase* var = Variable(i);
+        uint8_t slots = var->CounterSlots();
+        if (slots == 0) {
+            continue;
+        }
+        if (strlen(var->_key) > NVS_KEY_NAME_MAX_SIZE - 2) {
+            LOG(eLogError, "Counter key %s is longer than %d characters", var->_key, NVS_KEY_NAME_MAX_SIZE - 2);
+            ret = eFAILED;
+            continue;
+        }
+        for (uint8_t slot = 0; slot < slots; slot++) {
+            char key[NVS_KEY_NAME_MAX_SIZE];
+            counterSlotKey(key, var->_key, slot);
+            if (Find(key) != nullptr) {
+                LOG(eLogError, "Variable %s is a slot key of counter %s", key, var->_key);
+                ret = eFAILED;
+            }
+        }
+    }
+    return ret;
+}
+
+bool zPrefBase::readCounterSlot(zPrefVariableBase* var, uint8_t slot, nvs_type_t type, void* val)
+{
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    counterSlotKey(key, var->_key, slot);
+    return storage(var->_shard).Get(key, type, val, nullptr) == ESP_OK;
+}
+
+size_t zPrefBase::writeCounterSlot(zPrefVariableBase* var, uint8_t slot, nvs_type_t type, const void* val, size_t len)
+{
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    counterSlotKey(key, var->_key, slot);
+    touchShard(var->_shard);
+    esp_err_t err = storage(var->_shard).Set(key, type, val, len);
+    countWrite(var, ZPREF_NVS_ENTRY_SIZE);
+    if (err != ESP_OK) {
+        LOG(eLogWarn, "Error writing %s: %s", key, esp_err_to_name(err));
+        return 0;
+    }
+    return len;
+}
+
+//==============================================================================
+//  Packed groups
+//==============================================================================
+zPrefPackedGroup::zPrefPackedGroup(const char * const key, uint8_t version, zPrefBase& config,
+    zPrefVariableBase * const * members, uint16_t count, uint8_t * const image, size_t imageSize) :
+    _key(key), _version(version), _config(config), _members(members), _count(count),
+    _image(image), _imageSize(imageSize)
+{
+    for (uint16_t i = 0; i < _count; i++) {
+        _members[i]->_group = this;
+    }
+}
+
+uint32_t zPrefPackedGroup::layoutHash()
+{
+    uint32_t h = zPrefHash("");
+    for (uint16_t i = 0; i < _count; i++) {
+        h = zPrefHash(_members[i]->_key, h);
+        h = (h ^ (uint8_t)_members[i]->Kind()) * 16777619u;
+    }
+    return h;
+}
+
+// Packs the cached member values into the image, changed is set when any byte differs
+// Header: version, reserved, member count (u16), layout hash (u32), all little endian
+// Followed by the bools as a bitfield, padding to 8 bytes and the integers widest first
+size_t zPrefPackedGroup::pack(bool& changed)
+{
+    uint8_t header[kHeaderSize] = { _version, 0, (uint8_t)_count, (uint8_t)(_count >> 8) };
+    uint32_t hash = layoutHash();
+    for (size_t i = 0; i < 4; i++) {
+        header[4 + i] = (uint8_t)(hash >> (8 * i));
+    }
+    changed = memcmp(_image, header, kHeaderSize) != 0;
+    memcpy(_image, header, kHeaderSize);
+
+    size_t pos = kHeaderSize;
+    uint16_t bit = 0;
+    for (uint16_t i = 0; i < _count; i++) {
+        if (_members[i]->Kind() != eZPrefBool) {
+            continue;
+        }
+        uint8_t val = 0;
+        _members[i]->Serialize(&val, sizeof(val));
+        uint8_t& byte = _image[pos + bit / 8];
+        uint8_t mask = (uint8_t)(1 << (bit % 8));
+        uint8_t next = val ? (uint8_t)(byte | mask) : (uint8_t)(byte & ~mask);
+        changed |= (next != byte);
+        byte = next;
+        bit++;
+    }
+    pos += (bit + 7) / 8;
+    pos = (pos + 7) & ~(size_t)7;
+
+    static const size_t widths[] = { 8, 4, 2, 1 };
+    for (size_t width : widths) {
+        for (uint16_t i = 0; i < _count; i++) {
+            zPrefVariableBase* var = _members[i];
+            if ((var->Kind() == eZPrefBool) || (var->Serialize(nullptr, 0) != width)) {
+                continue;
+            }
+            uint8_t val[8];
+            var->Serialize(val, sizeof(val));
+            changed |= memcmp(&_image[pos], val, width) != 0;
+            memcpy(&_image[pos], val, width);
+            pos += width;
+        }
+    }
+    return pos;
+}
+
+void zPrefPackedGroup::Load()
+{
+    ZPREF_LOCK_WRITES(_config);
+    if (!_imageValid) {
+        // Compare what NVS holds with the image the current layout produces -
+        // only the header and size matter, the values are unpacked below
+        bool changed;
+        size_t size = pack(changed);
+        uint8_t header[kHeaderSize];
+        memcpy(header, _image, kHeaderSize);
+        size_t read = _config.nvs_getBlob(_key, _image, _imageSize);
+        _imageValid = (read == size) && (memcmp(header, _image, kHeaderSize) == 0);
+        if (!_imageValid && (read != 0)) {
+            LOG(eLogWarn, "Packed group %s has a different layout, using defaults", _key);
+        }
+    }
+
+    size_t pos = kHeaderSize;
+    uint16_t bit = 0;
+    uint16_t bools = 0;
+    for (uint16_t i = 0; i < _count; i++) {
+        bools += (_members[i]->Kind() == eZPrefBool) ? 1 : 0;
+    }
+    size_t ints = (kHeaderSize + (bools + 7) / 8 + 7) & ~(size_t)7;
+
+    for (uint16_t i = 0; i < _count; i++) {
+        zPrefVariableBase* var = _members[i];
+        if (var->Kind() == eZPrefBool) {
+            uint8_t val = (_image[pos + bit / 8] >> (bit % 8)) & 1;
+            bit++;
+            if (!var->initialized) {
+                if (_imageValid) {
+                    var->Deserialize(&val, sizeof(val));
+                } else {
+                    var->Preload(false);
+                }
+            }
+        }
+    }
+
+    static const size_t widths[] = { 8, 4, 2, 1 };
+    for (size_t width : widths) {
+        for (uint16_t i = 0; i < _count; i++) {
+            zPrefVariableBase* var = _members[i];
+            if ((var->Kind() == eZPrefBool) || (var->Serialize(nullptr, 0) != width)) {
+                continue;
+            }
+            if (!var->initialized) {
+                if (_imageValid) {
+                    var->Deserialize(&_image[ints], width);
+                } else {
+                    var->Preload(false);
+                }
+            }
+            ints += width;
+        }
+    }
+}
+
+void zPrefPackedGroup::Prepare()
+{
+    for (uint16_t i = 0; i < _count; i++) {
+        if (!_members[i]->initialized) {
+            // Members not loaded yet would otherwise overwrite their stored values with defaults
+            Load();
+            break;
+        }
+    }
+}
+
+// Flush() prepares the groups it writes before releasing the write lock, so this
+// only loads - and takes the write lock - for callers already holding it
+size_t zPrefPackedGroup::Write(zPrefVariableBase * const member)
+{
+    ZPREF_LOCK_STORAGE(_config);
+    Prepare();
+
+    bool changed;
+    size_t size = pack(changed);
+    if (!changed && _imageValid) {
+        LOG(eLogDebug, "Packed group %s unchanged, skipping write", _key);
+        _config.countSkipped(member);
+        return size;
+    }
+
+    size_t ret = _config.nvs_putBlob(_key, _image, size);
+    _config.countWrite(member, zPrefEntryBytes(size));
+    _imageValid = (ret != 0);
+    return ret;
+}
+
+//==============================================================================
+//  Snapshots
+//==============================================================================
+zPrefSnapshotBase::zPrefSnapshotBase(zPrefBase& config, zPrefVariableBase * const * members,
+    const size_t * offsets, uint16_t count, uint8_t * const first, uint8_t * const second) :
+    _config(config), _members(members), _offsets(offsets), _count(count), _buffers{ first, second }
+{
+#if ZPREF_THREAD_SAFE
+    _readers[0] = 0;
+    _readers[1] = 0;
+#endif
+    for (uint16_t i = 0; i < _count; i++) {
+        _config.Subscribe(_members[i], onChange, this);
+    }
+}
+
+zPrefSnapshotBase::~zPrefSnapshotBase()
+{
+    _config.Unsubscribe(onChange, this);
+}
+
+void zPrefSnapshotBase::onChange(zPrefVariableBase& var, void * ctx)
+{
+    (void)var;
+    ((zPrefSnapshotBase*)ctx)->Refresh();
+}
+
+void zPrefSnapshotBase::Refresh()
+{
+    ZPREF_LOCK_WRITES(_config);
+    uint8_t next = _active ^ 1;
+#if ZPREF_THREAD_SAFE
+    while (_readers[next] != 0) {
+        vTaskDelay(1);      // Still pinned by a reader of the snapshot before last
+    }
+#endif
+    for (uint16_t i = 0; i < _count; i++) {
+        zPrefVariableBase* var = _members[i];
+        if (!var->initialized) {
+            var->Preload(true);     // Loads from NVS, or the default if not stored
+        }
+        var->Serialize(_buffers[next] + _offsets[i], sizeof(uint64_t));
+    }
+    _active = next;
+    _generation++;
+}
+
+const uint8_t * zPrefSnapshotBase::acquire(uint8_t& buffer)
+{
+    if (_generation == 0) {
+        Refresh();          // First read - nothing published yet
+    }
+#if ZPREF_THREAD_SAFE
+    // Pin, then check the buffer is still the active one - a writer may have
+    // swapped in between and started refilling it
+    for (;;) {
+        buffer = _active;
+        _readers[buffer]++;
+        if (_active == buffer) {
+            break;
+        }
+        _readers[buffer]--;
+    }
+#else
+    buffer = _active;
+#endif
+    return _buffers[buffer];
+}
+
+void zPrefSnapshotBase::release(uint8_t buffer)
+{
+#if ZPREF_THREAD_SAFE
+    _readers[buffer]--;
+#else
+    (void)buffer;
+#endif
+}
+
+//==============================================================================
+//  Blob variables
+//==============================================================================
+zPrefBlob::zPrefBlob(const char * const key, const char * const def, zPrefBase& config,
+    void * buffer, size_t capacity, eZPrefType kind) :
+    zPrefVariableBase(key), _config(config), _buffer((uint8_t*)buffer),
+    _capacity((buffer != nullptr) ? capacity : 0), _arenaSize((buffer != nullptr) ? 0 : capacity),
+    _kind(kind), _default(def)
+{
+}
+
+void zPrefBlob::BindArena(uint8_t * const buf)
+{
+    _buffer = buf;
+    _capacity = _arenaSize;
+    load(nullptr, 0);
+}
+
+void zPrefBlob::load(const uint8_t* data, size_t len)
+{
+    if (_buffer == nullptr) {
+        // Arena not bound yet - nowhere to hold a value
+        _size = 0;
+        return;
+    }
+    if (_arenaSize > 0) {
+        _config.arenaResize(_size, std::min(len, maxSize()));
+    }
+    _size = std::min(len, maxSize());
+    if ((data != nullptr) && (_size > 0) && (data != _buffer)) {
+        memmove(_buffer, data, _size);
+    }
+    if (_kind == eZPrefText) {
+        _buffer[_size] = '\0';
+    }
+}
+
+void zPrefBlob::initialize()
+{
+    ZPREF_LOCK_WRITES(_config);
+    if (initialized) return;    // Loaded by another task while waiting for the lock
+    ZPREF_TIMESTAMP(start);
+
+    // NVS reads straight into the buffer, the size includes the terminator for text
+    size_t len = _capacity;
+    esp_err_t err = !_stored ? ESP_ERR_NVS_NOT_FOUND : (_kind == eZPrefText) ?
+        _config.storage(_shard).Get(_key, NVS_TYPE_STR, _buffer, &len) :
+        _config.storage(_shard).Get(_key, NVS_TYPE_BLOB, _buffer, &len);
+    if ((err == ESP_OK) && (_buffer != nullptr)) {
+        load(_buffer, (_kind == eZPrefText) ? len - 1 : len);
+    } else {
+        if (err == ESP_ERR_NVS_INVALID_LENGTH) {
+            LOG(eLogWarn, "Value of %s exceeds its %d byte buffer, using default", _key, (int)_capacity);
+        }
+        load((const uint8_t*)_default, (_default != nullptr) ? strlen(_default) : 0);
+    }
+    ZPREF_RECORD(_readLatency, start);
+    initialized = true;
+}
+
+size_t zPrefBlob::write()
+{
+    ZPREF_TIMESTAMP(start);
+    _config.touchShard(_shard);
+    esp_err_t err = (_kind == eZPrefText) ?
+        _config.storage(_shard).Set(_key, NVS_TYPE_STR, _buffer, _size + 1) :
+        _config.storage(_shard).Set(_key, NVS_TYPE_BLOB, _buffer, _size);
+    _stored = true;
+    ZPREF_RECORD(_writeLatency, start);
+    _config.countWrite(this, zPrefEntryBytes(_size + ((_kind == eZPrefText) ? 1 : 0)));
+    if (err != ESP_OK) {
+        LOG(eLogWarn, "Error writing %s: %s", _key, esp_err_to_name(err));
+        return 0;
+    }
+    return _size;
+}
+
+void zPrefBlob::Preload(bool present)
+{
+    if (present) {
+        initialize();
+    } else {
+        load((const uint8_t*)_default, (_default != nullptr) ? strlen(_default) : 0);
+        initialized = true;
+    }
+}
+
+size_t zPrefBlob::Size()
+{
+    if (!initialized) {
+        initialize();
+    }
+    return _size;
+}
+
+const uint8_t * zPrefBlob::Data()
+{
+    if (!initialized) {
+        initialize();
+    }
+    return (_buffer != nullptr) ? _buffer : (const uint8_t*)"";
+}
+
+size_t zPrefBlob::Read(void * dst, size_t len, size_t offset)
+{
+    ZPREF_LOCK_WRITES(_config);
+    size_t size = Size();
+    if (offset >= size) {
+        return 0;
+    }
+    len = std::min(len, size - offset);
+    memcpy(dst, _buffer + offset, len);
+    return len;
+}
+
+size_t zPrefBlob::WriteTo(Print& out)
+{
+    ZPREF_LOCK_WRITES(_config);
+    size_t size = Size();
+    return (size > 0) ? out.write(_buffer, size) : 0;
+}
+
+size_t zPrefBlob::Encode(uint8_t * const buf, size_t len)
+{
+    ZPREF_LOCK_WRITES(_config);
+    size_t size = Size();
+    if ((size > 0) && (size <= len)) {
+        memcpy(buf, _buffer, size);
+    }
+    return size;
+}
+
+size_t zPrefBlob::Set(const void * data, size_t len)
+{
+    if (len > maxSize()) {
+        LOG(eLogWarn, "Value of %d bytes does not fit %s", (int)len, _key);
+        return 0;
+    }
+
+    ZPREF_LOCK_WRITES(_config);
+    if (_config._writeElision && (Size() == len) && ((len == 0) || (memcmp(_buffer, data, len) == 0))) {
+        _config._skippedWrites++;
+        _config.countSkipped(this);
+        return 1;
+    }
+
+    load((const uint8_t*)data, len);
+    initialized = true;
+    size_t ret = write();
+    _config.commit();
+    _config.notify(this);
+    return ret;
+}
+
+size_t zPrefBlob::SetDefault()
+{
+    return Set(_default, (_default != nullptr) ? strlen(_default) : 0);
+}
+
+void zPrefBlob::BeginWrite()
+{
+    _writing = true;
+    _size = 0;
+    initialized = true;     // The stored value is being replaced
+    load(_buffer, 0);
+}
+
+size_t zPrefBlob::Append(const void * data, size_t len)
+{
+    if (!_writing) {
+        return 0;
+    }
+    len = std::min(len, maxSize() - _size);
+    memcpy(_buffer + _size, data, len);
+    load(_buffer, _size + len);
+    return len;
+}
+
+size_t zPrefBlob::EndWrite()
+{
+    if (!_writing) {
+        return 0;
+    }
+    _writing = false;
+
+    ZPREF_LOCK_WRITES(_config);
+    size_t ret = write();
+    _config.commit();
+    _config.notify(this);
+    return ret;
+}
+
+size_t zPrefBlob::ReadFrom(Stream& in, size_t len)
+{
+    if (len > maxSize()) {
+        LOG(eLogWarn, "Value of %d bytes does not fit %s", (int)len, _key);
+        return 0;
+    }
+
+    BeginWrite();
+    size_t read = in.readBytes((char*)_buffer, len);
+    load(_buffer, read);
+    if (read != len) {
+        LOG(eLogWarn, "Stream ended after %d of %d bytes, %s not written", (int)read, (int)len, _key);
+        _writing = false;
+        initialized = false;    // Reloaded from NVS on the next access
+        return 0;
+    }
+    return EndWrite();
+}
+
+size_t zPrefBlob::FromString(const char * const value)
+{
+    if (_kind == eZPrefText) {
+        return Set(value);
+    }
+
+    // Binary values are hex encoded - validated before the buffer is touched
+    size_t len = strlen(value);
+    if (((len % 2) != 0) || ((len / 2) > maxSize())) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (hexDigit(value[i]) < 0) {
+            return 0;
+        }
+    }
+
+    ZPREF_LOCK_WRITES(_config);
+    for (size_t i = 0; i < len / 2; i++) {
+        _buffer[i] = (uint8_t)((hexDigit(value[2 * i]) << 4) | hexDigit(value[2 * i + 1]));
+    }
+    load(_buffer, len / 2);
+    initialized = true;
+    size_t ret = write();
+    _config.commit();
+    _config.notify(this);
+    return ret;
+}
+
+size_t zPrefBlob::ExportValue(Print& out, char * const scratch, size_t len)
+{
+    ZPREF_LOCK_WRITES(_config);
+    size_t size = Size();
+    if (_kind == eZPrefText) {
+        return printEscaped(out, (const char*)_buffer, size);
+    }
+
+    // Hex encoded through the scratch buffer, no copy of the whole value
+    size_t written = 0;
+    size_t chunk = len / 2;
+    for (size_t pos = 0; pos < size; pos += chunk) {
+        size_t n = std::min(chunk, size - pos);
+        for (size_t i = 0; i < n; i++) {
+            scratch[2 * i] = hexChars[_buffer[pos + i] >> 4];
+            scratch[2 * i + 1] = hexChars[_buffer[pos + i] & 0x0F];
+        }
+        written += out.write((const uint8_t*)scratch, 2 * n);
+    }
+    return written;
+}
+
+bool zPrefBlob::GetString(char * const buf, size_t len, size_t * const required)
+{
+    ZPREF_LOCK_WRITES(_config);
+    size_t size = Size();
+    size_t needed = (_kind == eZPrefText) ? size : 2 * size;
+    if (required != nullptr) {
+        *required = needed + 1;
+    }
+    if (len == 0) {
+        return false;
+    }
+
+    // Truncated like snprintf if the buffer is too small
+    size_t written = std::min(needed, len - 1);
+    if (_kind == eZPrefText) {
+        memcpy(buf, _buffer, written);
+    } else {
+        written &= ~(size_t)1;
+        for (size_t i = 0; i < written / 2; i++) {
+            buf[2 * i] = hexChars[_buffer[i] >> 4];
+            buf[2 * i + 1] = hexChars[_buffer[i] & 0x0F];
+        }
+    }
+    buf[written] = '\0';
+    return needed < len;
+}
+
+String zPrefBlob::GetString()
+{
+    ZPREF_LOCK_WRITES(_config);
+    if (_kind == eZPrefText) {
+        return String(c_str());
+    }
+
+    size_t size = Size();
+    String result;
+    result.reserve(2 * size);
+    for (size_t i = 0; i < size; i++) {
+        result += hexChars[_buffer[i] >> 4];
+        result += hexChars[_buffer[i] & 0x0F];
+    }
+    return result;
+}
+
+//==============================================================================
+//  zPref class implementation
+//==============================================================================
+
+eStatus zPref::Init(const char* partition_name, bool preload) {
+    eStatus retVal = eOK;
+    status = eINPROGRESS;
+    _partition_name = partition_name;
+    LOG(eLogInfo, "Initializing NVS partition: %s, namespace: %s", _partition_name, _namespace);
+    ZPREF_TIMESTAMP(initStart);
+    buildIndex();
+    if ((checkCounterKeys() != eOK) || (bindArena() != eOK)) {
+        status = eFAILED;
+        return eFAILED;
+    }
+
+    // Initialize NVS flash partition, unless InitAll() already did
+    bool partitionsReady = _partitionsReady;
+    _partitionsReady = false;
+    ZPREF_TIMESTAMP(phaseStart);
+    esp_err_t err = partitionsReady ? ESP_OK : _storage->InitPartition(_partition_name);
+#if ZPREF_ENABLE_TIMING
+    _timing.partitionInitUs = esp_timer_get_time() - phaseStart;
+#endif
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        LOG(eLogWarn, "NVS partition needs erasing, erasing partition %s", _partition_name);
+        ZPREF_TIMESTAMP(eraseStart);
+        ESP_ERROR_CHECK(_storage->ErasePartition(_partition_name));
+        err = _storage->InitPartition(_partition_name);
+#if ZPREF_ENABLE_TIMING
+        _timing.eraseUs = esp_timer_get_time() - eraseStart;
+#endif
+    }
+
+    if (err != ESP_OK) {
+        LOG(eLogWarn, "Error initializing NVS flash partition %s: %s", _partition_name, esp_err_to_name(err));
+        retVal = eFAILED;
+    } else {
+        // Open NVS handle with the specified partition
+        ZPREF_TIMESTAMP(openStart);
+        err = _storage->Open(_partition_name, _namespace);
+#if ZPREF_ENABLE_TIMING
+        _timing.openUs = esp_timer_get_time() - openStart;
+#endif
+        if (err != ESP_OK) {
+            LOG(eLogWarn, "Error opening NVS namespace %s in partition %s: %s",
+                _namespace, _partition_name, esp_err_to_name(err));
+            retVal = eFAILED;
+        } else if (openShards(partitionsReady) != eOK) {
+            retVal = eFAILED;
+        } else {
+            replayJournal();
+
+            ZPREF_TIMESTAMP(preloadStart);
+            this->preload(preload);
+#if ZPREF_ENABLE_TIMING
+            _timing.preloadUs = esp_timer_get_time() - preloadStart;
+#endif
+
+            // Read stored configuration version
+            ZPREF_TIMESTAMP(onInitStart);
+            uint32_t storedVersion = nvs_getULong(CONFIG_VERSION_KEY, 0);
+
+            // Check if migration is needed
+            if (storedVersion != _currentVersion) {
+                LOG(eLogInfo, "Configuration version mismatch: stored=%d, current=%d",
+                    storedVersion, _currentVersion);
+
+                // Migration table, then the user's hook - committed once, version last,
+                // journaled up to ZPREF_JOURNAL_MAX so that a power loss cannot leave it half applied
+                bool journaled = _journaled;
+                _journaled = true;
+                BeginBatch();
+                retVal = migrate(storedVersion);
+                if (retVal == eOK) {
+                    retVal = OnInit(storedVersion, _currentVersion);
+                }
+
+                // If migration was successful, update the stored version
+                if (retVal == eOK) {
+                    _versionPending = true;
+                    CommitBatch();
+                    LOG(eLogInfo, "Configuration version updated to %d", _currentVersion);
+                } else {
+                    AbortBatch();
+                }
+                _journaled = journaled;
+            } else {
+                // Versions match, just call OnInit with matching versions
+                retVal = OnInit(storedVersion, _currentVersion);
+            }
+#if ZPREF_ENABLE_TIMING
+            _timing.onInitUs = esp_timer_get_time() - onInitStart;
+#endif
+        }
+    }
+
+#if ZPREF_ENABLE_TIMING
+    _timing.totalUs = esp_timer_get_time() - initStart;
+#endif
+    status = (retVal == eOK) ? eOK : eFAILED;
+    return retVal;
+}
+
+esp_err_t zPref::initPartition(zPrefStorage& storage, const char* partition) {
+    esp_err_t err = storage.InitPartition(partition);
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        LOG(eLogWarn, "NVS partition needs erasing, erasing partition %s", partition);
+        ESP_ERROR_CHECK(storage.ErasePartition(partition));
+        err = storage.InitPartition(partition);
+    }
+    return err;
+}
+
+// Takes the next instance until all are started or one failed
+static void runInits(zPrefInitContext* ctx) {
+    size_t i;
+    while (!ctx->failed && ((i = ctx->next++) < ctx->count)) {
+        if (ctx->configs[i]->Init(ctx->partition, ctx->preload) != eOK) {
+            LOG(eLogWarn, "Init of instance %d failed, not starting the remaining ones", (int)i);
+            ctx->failed = true;
+        }
+    }
+}
+
+static void initTask(void* arg) {
+    zPrefInitContext* ctx = static_cast<zPrefInitContext*>(arg);
+    runInits(ctx);
+    xTaskNotifyGive(ctx->waiter);
+    vTaskDelete(NULL);
+}
+
+eStatus zPref::InitAll(zPref* const * configs, size_t count, const char* partition_name, bool preload) {
+    // Every partition once, before any instance opens a namespace in it
+    std::vector<const char*> partitions;
+    for (size_t i = 0; i < count; i++) {
+        zPref* config = configs[i];
+        for (uint8_t shard = 0; shard < config->_shardCount; shard++) {
+            const char* partition = ((shard == 0) || (config->_shards[shard - 1].partition == nullptr)) ?
+                partition_name : config->_shards[shard - 1].partition;
+            bool initialized = false;
+            for (const char* other : partitions) {
+                initialized |= (strcmp(partition, other) == 0);
+            }
+            if (initialized) {
+                continue;
+            }
+            esp_err_t err = initPartition(config->storage(shard), partition);
+            if (err != ESP_OK) {
+                LOG(eLogWarn, "Error initializing NVS flash partition %s: %s", partition, esp_err_to_name(err));
+                return eFAILED;
+            }
+            partitions.push_back(partition);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        configs[i]->_partitionsReady = true;
+    }
+
+    zPrefInitContext ctx;
+    ctx.configs = configs;
+    ctx.count = count;
+    ctx.partition = partition_name;
+    ctx.preload = preload;
+    ctx.waiter = xTaskGetCurrentTaskHandle();
+
+    // Helpers on the other cores, the calling task takes instances as well
+    size_t started = 0;
+    BaseType_t core = xPortGetCoreID();
+    for (size_t i = 1; (i < ZPREF_INIT_TASKS) && (i < count); i++) {
+        if (xTaskCreatePinnedToCore(initTask, "zPrefInit", ZPREF_INIT_STACK, &ctx,
+                uxTaskPriorityGet(NULL), NULL, (core + i) % portNUM_PROCESSORS) != pdPASS) {
+            LOG(eLogWarn, "Error creating init task, continuing with %d", (int)(started + 1));
+            break;
+        }
+        started++;
+    }
+    runInits(&ctx);
+    for (; started > 0; started--) {
+        ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        configs[i]->_partitionsReady = false;   // Not started after a failure
+    }
+    return ctx.failed ? eFAILED : eOK;
+}
+
+uint8_t zPref::AddShard(const char* nvs_namespace, const char* partition_name, zPrefStorage* storage) {
+    if (_shardCount >= ZPREF_MAX_SHARDS) {
+        LOG(eLogError, "Cannot add shard %s, ZPREF_MAX_SHARDS is %d", nvs_namespace, ZPREF_MAX_SHARDS);
+        return 0;
+    }
+    zPrefShard& shard = _shards[_shardCount - 1];
+    shard.ns = nvs_namespace;
+    shard.partition = partition_name;
+    shard.storage = (storage != nullptr) ? storage : &shard.nvs;
+    return _shardCount++;
+}
+
+zPrefStorage& zPref::storage(uint8_t shard) {
+    return ((shard == 0) || (shard >= _shardCount)) ? *_storage : *_shards[shard - 1].storage;
+}
+
+eStatus zPref::openShards(bool partitionsReady) {
+    for (uint8_t i = 1; i < _shardCount; i++) {
+        zPrefShard& shard = _shards[i - 1];
+        const char* partition = (shard.partition != nullptr) ? shard.partition : _partition_name;
+
+        // Each partition is initialized once, however many namespaces it holds
+        bool initialized = partitionsReady || (strcmp(partition, _partition_name) == 0);
+        for (uint8_t j = 1; (j < i) && !initialized; j++) {
+            const char* other = (_shards[j - 1].partition != nullptr) ? _shards[j - 1].partition : _partition_name;
+            initialized = (strcmp(partition, other) == 0);
+        }
+
+        esp_err_t err = initialized ? ESP_OK : initPartition(*shard.storage, partition);
+        if (err == ESP_OK) {
+            err = shard.storage->Open(partition, shard.ns);
+        }
+        if (err != ESP_OK) {
+            LOG(eLogWarn, "Error opening NVS namespace %s in partition %s: %s",
+                shard.ns, partition, esp_err_to_name(err));
+            return eFAILED;
+        }
+    }
+    return eOK;
+}
+
+// Records which keys are stored, so that lazy loads of the others skip the lookup,
+// and with load fills every variable in the same pass
+void zPref::preload(bool load) {
+    LOG(eLogDebug, "Scanning %d variables in namespace %s%s", (int)VariableCount(), _namespace,
+        load ? ", preloading" : "");
+
+    for (size_t i = 0; i < VariableCount(); i++) {
+        Variable(i)->_stored = false;
+    }
+
+    // Keys present in each namespace - one pass with the storage iterator
+    struct PreloadContext {
+        zPref*  config;
+        uint8_t shard;
+        bool    load;
+    };
+    uint32_t failedShards = 0;
+    for (uint8_t shard = 0; shard < _shardCount; shard++) {
+        PreloadContext ctx = { this, shard, load };
+        esp_err_t err = storage(shard).ForEachKey([](const char* key, void* arg) {
+            PreloadContext* ctx = (PreloadContext*)arg;
+            zPrefVariableBase* var = ctx->config->Find(key);
+            if ((var != nullptr) && (var->_shard == ctx->shard)) {
+                var->_stored = true;
+                if (ctx->load) {
+                    var->Preload(true);
+                }
+            }
+        }, &ctx);
+        if (err != ESP_OK) {
+            // Backend cannot list its keys - look the variables of this shard up
+            LOG(eLogWarn, "Key scan of shard %d of namespace %s failed, loading lazily: %s",
+                (int)shard, _namespace, esp_err_to_name(err));
+            failedShards |= 1u << shard;
+        }
+    }
+    if (failedShards != 0) {
+        for (size_t i = 0; i < VariableCount(); i++) {
+            zPrefVariableBase* var = Variable(i);
+            if (failedShards & (1u << var->_shard)) {
+                var->_stored = true;
+            }
+        }
+    }
+
+    if (!load) {
+        return;
+    }
+
+    // Everything not found in NVS uses its default
+    for (size_t i = 0; i < VariableCount(); i++) {
+        zPrefVariableBase* var = Variable(i);
+        if (var->initialized) {
+            continue;
+        }
+        if (var->_group != nullptr) {
+            zPrefShardScope scope(*this, var->_shard);
+            var->_group->Load();   // One blob read fills the whole group
+        } else {
+            var->Preload(var->_stored);
+        }
+    }
+}
+
+eStatus zPref::migrate(uint32_t storedVersion) {
+    uint32_t version = storedVersion;
+    size_t applied = 0;
+
+    // Each step is applied at most once, which also stops a cyclic table
+    while ((version != 0) && (version != _currentVersion) && (applied < _migrationCount)) {
+        const zPrefMigration* step = nullptr;
+        for (size_t i = 0; i < _migrationCount; i++) {
+            if (_migrations[i].from == version) {
+                step = &_migrations[i];
+                break;
+            }
+        }
+        if (step == nullptr) {
+            LOG(eLogDebug, "No migration step from v%d, left to OnInit", version);
+            break;
+        }
+
+        LOG(eLogInfo, "Migrating configuration from v%d to v%d", step->from, step->to);
+        if (step->apply(*this) != eOK) {
+            LOG(eLogError, "Migration from v%d to v%d failed", step->from, step->to);
+            return eFAILED;
+        }
+        version = step->to;
+        applied++;
+    }
+
+    return eOK;
+}
+
+void zPref::batchPersisted() {
+    if (_versionPending) {
+        // After every staged value, so an interrupted migration is redone on the next boot
+        _versionPending = false;
+        nvs_putULong(CONFIG_VERSION_KEY, _currentVersion);
+        _commitPending = true;
+    }
+}
+
+size_t zPref::journalRecords(Print& out) {
+    if (!_versionPending) {
+        return 0;
+    }
+    out.printf("%s=%u\n", CONFIG_VERSION_KEY, (unsigned)_currentVersion);
+    return 1;
+}
+
+void zPref::replayJournal() {
+    size_t size = 0;
+    if ((storage(0).Get(ZPREF_JOURNAL_KEY, NVS_TYPE_BLOB, NULL, &size) != ESP_OK) || (size == 0)) {
+        return;
+    }
+    std::vector<char> journal(size + 1);
+    if (nvs_getBlob(ZPREF_JOURNAL_KEY, journal.data(), size) != size) {
+        LOG(eLogError, "Error reading the batch journal");
+        return;
+    }
+    journal[size] = '\0';
+    LOG(eLogWarn, "Replaying a batch interrupted by a power loss, %d bytes", (int)size);
+
+    // Idempotent - interrupted again, it is replayed again on the next Init()
+    bool journaled = _journaled;
+    _journaled = false;
+    BeginBatch();
+    const size_t versionKeyLen = strlen(CONFIG_VERSION_KEY);
+    for (char* line = journal.data(); *line != '\0'; ) {
+        char* end = strchr(line, '\n');
+        if (end != nullptr) {
+            *end = '\0';
+        }
+        if ((strncmp(line, CONFIG_VERSION_KEY, versionKeyLen) == 0) && (line[versionKeyLen] == '=')) {
+            uint32_t version;
+            if (parseValue<uint32_t>(line + versionKeyLen + 1, version) == eConvOk) {
+                nvs_putULong(CONFIG_VERSION_KEY, version);
+                _commitPending = true;
+            }
+        } else {
+            importLine(line);
+        }
+        line = (end != nullptr) ? end + 1 : line + strlen(line);
+    }
+    CommitBatch();
+    _journaled = journaled;
+
+    storage(0).Erase(ZPREF_JOURNAL_KEY);
+    commit();
+}
+
+eStatus zPref::EraseKey(const char* key) {
+    ZPREF_LOCK_WRITES(*this);
+    esp_err_t err = storage(0).Erase(key);
+    zPrefVariableBase* var = Find(key);
+    if ((var != nullptr) && (var->_shard == 0)) {
+        var->_stored = false;
+    }
+    if ((err != ESP_OK) && (err != ESP_ERR_NVS_NOT_FOUND)) {
+        LOG(eLogWarn, "Error erasing key %s: %s", key, esp_err_to_name(err));
+        return eFAILED;
+    }
+    if (err == ESP_OK) {
+        if (InBatch()) {
+            _commitPending = true;
+        } else {
+            commit();
+        }
+    }
+    return eOK;
+}
+
+eStatus zPref::Reset() {
+    LOG(eLogInfo, "Resetting %d variables to their defaults", (int)VariableCount());
+    zPrefBatch batch(*this);
+    for (size_t i = 0; i < VariableCount(); i++) {
+        Variable(i)->SetDefault();
+    }
+    return eOK;
+}
+
+eStatus zPref::OnInit(uint32_t storedVersion, uint32_t currentVersion) {
     (void)storedVersion;
     (void)currentVersion;
     return eOK;
 }
 
+void zPref::DumpTiming() {
+#if ZPREF_ENABLE_TIMING
+    LOG(eLogInfo, "Init timing for namespace %s [us]: total=%d partition=%d erase=%d open=%d preload=%d onInit=%d",
+        _namespace, (int)_timing.totalUs, (int)_timing.partitionInitUs, (int)_timing.eraseUs,
+        (int)_timing.openUs, (int)_timing.preloadUs, (int)_timing.onInitUs);
+    LOG(eLogInfo, "  commit: n=%u min=%u max=%u avg=%u us", (unsigned)_timing.commit.count,
+        (unsigned)(_timing.commit.count ? _timing.commit.minUs : 0), (unsigned)_timing.commit.maxUs,
+        (unsigned)_timing.commit.AvgUs());
+    for (size_t i = 0; i < VariableCount(); i++) {
+        zPrefVariableBase* var = Variable(i);
+        const zPrefLatency& r = var->_readLatency;
+        const zPrefLatency& w = var->_writeLatency;
+        LOG(eLogInfo, "  %s: read n=%u min=%u max=%u avg=%u, write n=%u min=%u max=%u avg=%u us",
+            var->_key,
+            (unsigned)r.count, (unsigned)(r.count ? r.minUs : 0), (unsigned)r.maxUs, (unsigned)r.AvgUs(),
+            (unsigned)w.count, (unsigned)(w.count ? w.minUs : 0), (unsigned)w.maxUs, (unsigned)w.AvgUs());
+    }
+#endif
+}
+
+#if ZPREF_THREAD_SAFE
+zPref* zPref::_writeBehindList = nullptr;
+
+void zPref::writeBehindTask(void* arg) {
+    zPref* self = static_cast<zPref*>(arg);
+    while (!self->_writeBehindStop) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!self->_writeBehindStop) {
+            // Everything that changes during the debounce window goes into one commit
+            vTaskDelay(pdMS_TO_TICKS(self->_debounceMs));
+        }
+        self->Flush();
+    }
+
+    xTaskNotifyGive(self->_writeBehindWaiter);
+    vTaskDelete(NULL);
+}
+
+void zPref::writeBehindNotify() {
+    if (_writeBehindTask != NULL) {
+        xTaskNotifyGive(_writeBehindTask);
+    }
+}
+#endif
+
+eStatus zPref::EnableWriteBehind(uint32_t debounceMs, size_t queueLength) {
+#if ZPREF_THREAD_SAFE
+    if (status != eOK) {
+        LOG(eLogWarn, "Write-behind needs a successful Init()");
+        return eFAILED;
+    }
+    if (_writeBehind) {
+        return eOK;
+    }
+
+    ZPREF_LOCK_WRITES(*this);
+    _debounceMs = debounceMs;
+    _dirtyCapacity = (queueLength > 0) ? queueLength : 1;
+    _dirtyVariables.reserve(_dirtyCapacity);
+    _writeBehindStop = false;
+    if (xTaskCreate(writeBehindTask, "zPrefFlush", ZPREF_WRITE_BEHIND_STACK, this,
+            ZPREF_WRITE_BEHIND_PRIORITY, &_writeBehindTask) != pdPASS) {
+        LOG(eLogWarn, "Error creating write-behind task for namespace %s", _namespace);
+        _writeBehindTask = NULL;
+        return eFAILED;
+    }
+
+    if (_writeBehindList == nullptr) {
+        esp_register_shutdown_handler(FlushAll);
+    }
+    _writeBehindNext = _writeBehindList;
+    _writeBehindList = this;
+    _writeBehind = true;
+    LOG(eLogInfo, "Write-behind enabled for namespace %s, debounce %d ms", _namespace, (int)debounceMs);
+    return eOK;
+#else
+    (void)debounceMs;
+    (void)queueLength;
+    LOG(eLogWarn, "Write-behind requires building with ZPREF_THREAD_SAFE=1");
+    return eFAILED;
+#endif
+}
+
+void zPref::DisableWriteBehind() {
+#if ZPREF_THREAD_SAFE
+    if (!_writeBehind) {
+        return;
+    }
+
+    // Stop the task and wait for it to exit, then drain what is left
+    _writeBehindWaiter = xTaskGetCurrentTaskHandle();
+    _writeBehindStop = true;
+    xTaskNotifyGive(_writeBehindTask);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    _writeBehindTask = NULL;
+
+    for (zPref** p = &_writeBehindList; *p != nullptr; p = &(*p)->_writeBehindNext) {
+        if (*p == this) {
+            *p = _writeBehindNext;
+            break;
+        }
+    }
+    if (_writeBehindList == nullptr) {
+        esp_unregister_shutdown_handler(FlushAll);
+    }
+
+    ZPREF_LOCK_WRITES(*this);
+    _writeBehind = false;
+    Flush();
+#endif
+}
+
+void zPref::FlushAll() {
+#if ZPREF_THREAD_SAFE
+    for (zPref* p = _writeBehindList; p != nullptr; p = p->_writeBehindNext) {
+        p->Flush();
+    }
+#endif
+}
+
+eStatus zPref::StorageStats(nvs_stats_t& stats, size_t& namespaceEntries, uint8_t shard) {
+    esp_err_t err = storage(shard).Stats(&stats, &namespaceEntries);
+    if (err != ESP_OK) {
+        LOG(eLogWarn, "Error reading NVS statistics: %s", esp_err_to_name(err));
+        return eFAILED;
+    }
+    return eOK;
+}
+
 void zPref::End() {
+    DisableWriteBehind();
+    Flush();        // Rate-limited variables and counters not yet written
     LOG(eLogInfo, "Closing NVS handle");
-    if (_nvs_handle != 0) {
-        nvs_close(_nvs_handle);
-        _nvs_handle = 0;
+    for (uint8_t shard = 0; shard < _shardCount; shard++) {
+        storage(shard).Close();
     }
 }
@@ -33,28 +33,62 @@
 #include "zPrefBase.h"
 #include "nvs_flash.h"
 #include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 //==============================================================================
 //  Defines
 //==============================================================================
 #define CONFIG_VERSION_KEY      "CfgVersion"    // Maximum 15 characters per NVS spec
 
+#ifndef ZPREF_WRITE_BEHIND_STACK
+#define ZPREF_WRITE_BEHIND_STACK    4096
+#endif
+#ifndef ZPREF_WRITE_BEHIND_PRIORITY
+#define ZPREF_WRITE_BEHIND_PRIORITY 1
+#endif
+
+// Tasks InitAll() runs the Init() calls on, including the calling task
+#ifndef ZPREF_INIT_TASKS
+#define ZPREF_INIT_TASKS            2
+#endif
+#ifndef ZPREF_INIT_STACK
+#define ZPREF_INIT_STACK            4096
+#endif
+
 //==============================================================================
 //  Exported types
 //==============================================================================
 
+class zPref;
+
+/**
+ * @brief One step of the version migration table, see zPref::SetMigrations()
+ *
+ * apply only writes the keys that changed between the two versions; it runs
+ * inside the migration batch, so its Set() calls are committed together.
+ */
+struct zPrefMigration {
+    uint32_t from;
+    uint32_t to;
+    eStatus (*apply)(zPref& config);
+};
+
 /**
  * @brief Base class for NVS-backed preferences
  *
  * Users should inherit from this class and define their own configuration
- * variables using the DECLARE_CONFIG_VARIABLE macro.
+ * variables using the ZPREF_VARIABLES macro.
  *
  * Example:
  * @code
+ * #define MYCONFIG_VARIABLES(X) \
+ *     X(String, DeviceName)     \
+ *     X(Bool, EnableWifi)
+ *
  * class MyConfig : public zPref {
  *     public:
- *         DECLARE_CONFIG_VARIABLE(String, DeviceName);
- *         DECLARE_CONFIG_VARIABLE(Bool, EnableWifi);
+ *         ZPREF_VARIABLES(MYCONFIG_VARIABLES)
  *
  *         MyConfig() : zPref("MyApp", 1) {}
  * };
@@ -63,14 +97,57 @@
 class zPref : public zPrefBase
 {
     private:
-        nvs_handle_t _nvs_handle;
+        // A namespace in addition to the main one, see AddShard()
+        struct zPrefShard {
+            const char* ns = nullptr;
+            const char* partition = nullptr;    // nullptr for the partition given to Init()
+            zPrefNvsStorage nvs;
+            zPrefStorage* storage = nullptr;
+        };
+
+        zPrefNvsStorage _nvs;
+        zPrefStorage* _storage = &_nvs;
+        zPrefShard _shards[ZPREF_MAX_SHARDS - 1];
+        uint8_t _shardCount = 1;
         eStatus status = eNOTINITIALIZED;
         const char* _partition_name;
         const char* _namespace;
         uint32_t _currentVersion;
+        const zPrefMigration* _migrations = nullptr;
+        size_t _migrationCount = 0;
+        bool _versionPending = false;       // Written with the migration batch
+        bool _partitionsReady = false;      // Partitions initialized by InitAll()
+
+        static esp_err_t initPartition(zPrefStorage& storage, const char* partition);
+        void preload(bool load);
+        eStatus openShards(bool partitionsReady);
+        eStatus migrate(uint32_t storedVersion);
+        void replayJournal();
+
+    protected:
+        void batchPersisted() override;
+        size_t journalRecords(Print& out) override;
+
+    private:
+#if ZPREF_THREAD_SAFE
+        // Write-behind task state
+        TaskHandle_t _writeBehindTask = NULL;
+        TaskHandle_t _writeBehindWaiter = NULL;
+        uint32_t _debounceMs = 0;
+        std::atomic<bool> _writeBehindStop{false};
+        zPref* _writeBehindNext = nullptr;
+        static zPref* _writeBehindList;     // Instances drained by FlushAll()
+
+        static void writeBehindTask(void* arg);
+
+    protected:
+        void writeBehindNotify() override;
+#endif
 
     public:
-        nvs_handle_t& nvs_handle() { return _nvs_handle; };    // For zPrefBase
+        using zPrefBase::storage;
+        zPrefStorage& storage(uint8_t shard);               // For zPrefBase
+        nvs_handle_t& nvs_handle() { return _nvs.Handle(); };  // Of the default NVS backend
 
     public:
         /**
@@ -79,7 +156,6 @@ class zPref : public zPrefBase
          * @param currentVersion Current configuration version (for migration)
          */
         zPref(const char* nvs_namespace = "zPref", uint32_t currentVersion = 1) :
-            _nvs_handle(0),
             _partition_name(NVS_DEFAULT_PART_NAME),
             _namespace(nvs_namespace),
             _currentVersion(currentVersion) {};
@@ -87,15 +163,71 @@ class zPref : public zPrefBase
         /**
          * @brief Initialize the NVS partition and open the namespace
          * @param partition_name NVS partition name (defaults to NVS_DEFAULT_PART_NAME)
+         * @param preload Load all registered variables now, in one pass over the
+         *        namespace, instead of lazily on first Get()
          * @return eStatus - eOK on success, eFAILED on error
          */
-        eStatus Init(const char* partition_name = NVS_DEFAULT_PART_NAME);
+        eStatus Init(const char* partition_name = NVS_DEFAULT_PART_NAME, bool preload = false);
+
+        /**
+         * @brief Initialize several instances concurrently
+         * @param configs Instances to Init(partition_name, preload)
+         * @return eStatus - eOK if every Init() succeeded, eFAILED on the first error
+         *
+         * Initializes every partition of the instances and their shards once,
+         * then runs the Init() calls on up to ZPREF_INIT_TASKS tasks on
+         * alternating cores, the calling task being one of them - boot time
+         * is bounded by the slowest instances rather than their sum. After a
+         * failure no further Init() is started; instances not started keep
+         * Status() eNOTINITIALIZED. Returns once every started Init() is done.
+         * OnInit() hooks and migrations of different instances may run at
+         * the same time.
+         *
+         * Example:
+         * @code
+         * zPref* const configs[] = { &SystemConfig, &NetworkConfig, &AppConfig, &Calibration };
+         * if (zPref::InitAll(configs, 4) != eOK) { ... }
+         * @endcode
+         */
+        static eStatus InitAll(zPref* const * configs, size_t count,
+            const char* partition_name = NVS_DEFAULT_PART_NAME, bool preload = false);
+
+        /**
+         * @brief Use another storage backend instead of NVS, call before Init()
+         * @param storage Backend, must outlive this instance - e.g. zPrefMemoryStorage
+         *        for host builds, tests and benchmarks
+         */
+        void SetStorage(zPrefStorage& storage) { _storage = &storage; };
+
+        /**
+         * @brief Add a namespace to spread the variables over, call before Init()
+         * @param nvs_namespace NVS namespace (max 15 characters)
+         * @param partition_name Partition of the namespace, nullptr for the one given to Init()
+         * @param storage Optional backend, defaults to NVS
+         * @return Shard to pass to SetShard(), 0 (the main namespace) if ZPREF_MAX_SHARDS is reached
+         *
+         * Keeps frequently written variables apart from rarely changed ones, so
+         * that garbage collection of hot pages does not copy cold data. Init()
+         * initializes every partition once and opens all namespaces; a commit
+         * covers every shard written since the last one. Keys stay unique across
+         * the whole configuration and the version is kept in the main namespace.
+         *
+         * Example:
+         * @code
+         * MyConfig() : zPref("MyApp", 1) {
+         *     LastState.SetShard(AddShard("MyAppState"));
+         * }
+         * @endcode
+         */
+        uint8_t AddShard(const char* nvs_namespace, const char* partition_name = nullptr, zPrefStorage* storage = nullptr);
 
         /**
          * @brief Reset all configuration variables to defaults
          * @return eStatus - eOK on success
          *
-         * Users should override this method to reset their specific variables
+         * Writes the default of every variable declared with ZPREF_VARIABLES
+         * as a single batch. Override to reset only some of them, or to
+         * reset variables declared otherwise.
          */
         virtual eStatus Reset();
 
@@ -129,15 +261,109 @@ class zPref : public zPrefBase
         virtual eStatus OnInit(uint32_t storedVersion, uint32_t currentVersion);
 
         /**
-         * @brief Close the NVS handle
+         * @brief Register the version migration table, call before Init()
+         * @param steps Migration steps, must outlive the configuration
+         * @param count Number of steps
+         *
+         * On a version mismatch Init() opens a batch, applies the steps from the
+         * stored version onwards - each step is looked up by its from version and
+         * continues at its to version - then calls OnInit() and finally writes the
+         * version key, followed by a single commit. A failing step aborts the batch
+         * and leaves NVS, including the stored version, untouched.
+         *
+         * Version 0 (first boot or after an erase) needs no step: missing keys
+         * read as their defaults. Versions without a step are left to OnInit().
+         *
+         * Example:
+         * @code
+         * static eStatus addNewVariable(zPref& c) {
+         *     static_cast<MyConfig&>(c).NewVariable.SetDefault();
+         *     return eOK;
+         * }
+         * static eStatus dropOldVariable(zPref& c) { return c.EraseKey("OldVariable"); }
+         *
+         * static const zPrefMigration kMigrations[] = {
+         *     { 1, 2, addNewVariable },
+         *     { 2, 3, dropOldVariable },
+         * };
+         *
+         * MyConfig() : zPref("MyApp", 3) { SetMigrations(kMigrations, 2); }
+         * @endcode
+         */
+        void SetMigrations(const zPrefMigration* steps, size_t count) {
+            _migrations = steps;
+            _migrationCount = count;
+        };
+
+        /**
+         * @brief Remove a key no longer used by the configuration
+         * @param key NVS key, in the main namespace
+         * @return eStatus - eOK if removed or not present
+         *
+         * Meant for migration steps; the removal is committed with the batch.
+         */
+        eStatus EraseKey(const char* key);
+
+        /**
+         * @brief Persist writes from a background task instead of in Set()
+         * @param debounceMs Time to collect further changes before the flush
+         * @param queueLength Maximum distinct variables waiting for the flush -
+         *        Set() flushes synchronously when the queue is full
+         * @return eStatus - eOK on success, eFAILED if not initialized, the task
+         *         could not be created or ZPREF_THREAD_SAFE is not enabled
+         *
+         * Set() updates the cached value and queues the variable; repeated sets of
+         * the same variable are coalesced. The task writes everything queued in
+         * one commit. Flush() writes the queue immediately, End() drains it.
+         */
+        eStatus EnableWriteBehind(uint32_t debounceMs = 100, size_t queueLength = 32);
+
+        /**
+         * @brief Stop the write-behind task and flush the queue
+         */
+        void DisableWriteBehind();
+
+        /**
+         * @brief Flush the write-behind queue of every instance
+         *
+         * Registered as a shutdown handler, so it runs on esp_restart(). Call it
+         * from a brown-out or power-fail handler as well.
+         */
+        static void FlushAll();
+
+        /**
+         * @brief Write everything still queued, see Flush(), and close the NVS handle
          */
         void End();
 
+        /**
+         * @brief NVS entry statistics of the partition and of this namespace
+         * @param stats Receives nvs_get_stats() of the partition
+         * @param namespaceEntries Receives the entries used by this namespace
+         * @param shard Namespace to count the entries of, 0 for the main one
+         * @return eStatus - eFAILED if not initialized or not supported by the backend
+         */
+        eStatus StorageStats(nvs_stats_t& stats, size_t& namespaceEntries, uint8_t shard = 0);
+
         /**
          * @brief Get the current status
          * @return eStatus
          */
         eStatus Status() { return status; };
+
+#if ZPREF_ENABLE_TIMING
+        /**
+         * @brief Init phase and commit timings, requires ZPREF_ENABLE_TIMING
+         */
+        const zPrefTiming& Timing() { return _timing; };
+#endif
+
+        /**
+         * @brief Log Init phase timings and per-variable read/write latencies
+         *
+         * Does nothing unless built with ZPREF_ENABLE_TIMING=1
+         */
+        void DumpTiming();
 };
 
 //==============================================================================
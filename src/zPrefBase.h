@@ -31,42 +31,565 @@
 //  Includes
 //==============================================================================
 #include <vector>
-#include <functional>
 #include <Arduino.h>
 #include "nvs_flash.h"
 #include "nvs.h"
 #include <globals.h>
 #include <memory>
+#include <stddef.h>
+#include <string.h>
+#include <type_traits>
+#include <array>
 #include "type_converter.hpp"
+#include "zPrefStorage.h"
 #include <logger.h>
 
 //==============================================================================
 //  Defines
 //==============================================================================
+// Latency instrumentation for Init phases and NVS accesses, see zPrefTiming
+#ifndef ZPREF_ENABLE_TIMING
+#define ZPREF_ENABLE_TIMING         0
+#endif
+
+// Concurrent access from several tasks, see zPrefVariable::Get()
+#ifndef ZPREF_THREAD_SAFE
+#define ZPREF_THREAD_SAFE           0
+#endif
+
+// Per-variable and per-namespace write, commit and flash byte counters, see zPrefWearStats
+#ifndef ZPREF_ENABLE_WEAR_STATS
+#define ZPREF_ENABLE_WEAR_STATS     0
+#endif
+
+// Namespaces one zPref can spread its variables over, including its own
+#ifndef ZPREF_MAX_SHARDS
+#define ZPREF_MAX_SHARDS            4
+#endif
+static_assert(ZPREF_MAX_SHARDS <= 8, "zPref: at most 8 shards are supported");
+
+// Size of one NVS entry - scalars take one, strings and blobs a header plus their data
+#define ZPREF_NVS_ENTRY_SIZE        32
+
+// NVS key of the journal of an interrupted batch, see zPrefBase::SetJournal()
+#define ZPREF_JOURNAL_KEY           "CfgJournal"
+
+// Binary config delta, see zPrefBase::ComputeDelta()
+#define ZPREF_DELTA_MAGIC           0x447A      // "zD", little endian
+#define ZPREF_DELTA_VERSION         1
+#define ZPREF_DELTA_HEADER_SIZE     10          // Magic, version, reserved, u16 count, u32 sequence
+#define ZPREF_DELTA_ENTRY_SIZE      7           // u32 key hash, u8 type, u16 length, then the value
+#define ZPREF_DELTA_TRAILER_SIZE    4           // FNV-1a of everything before it
+
+// Bytes of String values with eZPrefCacheLru kept in RAM per config, see zPrefBase::SetCacheBudget()
+#ifndef ZPREF_CACHE_BUDGET
+#define ZPREF_CACHE_BUDGET          4096
+#endif
+
+// Elapsed time after which the next increment of a zPrefCounter persists it, 0 to disable
+#ifndef ZPREF_COUNTER_INTERVAL_MS
+#define ZPREF_COUNTER_INTERVAL_MS   60000
+#endif
+
+// Longest key=value line handled by Export() and Import() without allocating
+#ifndef ZPREF_LINE_MAX
+#define ZPREF_LINE_MAX              256
+#endif
+
+// Largest batch journal, bigger batches are committed without it, see zPrefBase::SetJournal()
+#ifndef ZPREF_JOURNAL_MAX
+#define ZPREF_JOURNAL_MAX           1024
+#endif
+
+#if ZPREF_THREAD_SAFE
+#include <atomic>
+#include <mutex>
+// Writers take both locks in this order; Set() in write-behind mode only needs the
+// state, and Flush() writes its queue holding the storage lock alone
+#define ZPREF_LOCK_STATE(config)    std::lock_guard<std::recursive_mutex> _stateGuard((config)._writeLock)
+#define ZPREF_LOCK_STORAGE(config)  std::lock_guard<std::recursive_mutex> _storageGuard((config)._storageLock)
+#define ZPREF_LOCK_WRITES(config)   ZPREF_LOCK_STATE(config); ZPREF_LOCK_STORAGE(config)
+#else
+#define ZPREF_LOCK_STATE(config)
+#define ZPREF_LOCK_STORAGE(config)
+#define ZPREF_LOCK_WRITES(config)
+#endif
+
+#if ZPREF_ENABLE_TIMING
+#include "esp_timer.h"
+#define ZPREF_TIMESTAMP(name)           int64_t name = esp_timer_get_time()
+#define ZPREF_RECORD(latency, start)    (latency).Record(esp_timer_get_time() - (start))
+#else
+#define ZPREF_TIMESTAMP(name)
+#define ZPREF_RECORD(latency, start)
+#endif
 
 //==============================================================================
 //  Exported types
 //==============================================================================
+#if ZPREF_THREAD_SAFE
+typedef std::atomic<bool>   zPrefFlag;
+template<typename T> using zPrefAtomic = std::atomic<T>;
+#else
+typedef bool                zPrefFlag;
+template<typename T> using zPrefAtomic = T;
+#endif
+
+#if ZPREF_ENABLE_TIMING
+/**
+ * @brief min/max/count statistics of an operation, in microseconds
+ */
+struct zPrefLatency {
+    uint32_t count = 0;
+    uint32_t minUs = UINT32_MAX;
+    uint32_t maxUs = 0;
+    uint64_t totalUs = 0;
+
+    void Record(int64_t us) {
+        count++;
+        if (us < minUs) minUs = us;
+        if (us > maxUs) maxUs = us;
+        totalUs += us;
+    };
+    uint32_t AvgUs() const { return count ? (uint32_t)(totalUs / count) : 0; };
+};
+
+/**
+ * @brief Boot phase timings of zPref::Init and NVS commit latencies
+ */
+struct zPrefTiming {
+    int64_t partitionInitUs = 0;    // nvs_flash_init_partition
+    int64_t eraseUs = 0;            // Erase and re-init, 0 if not needed
+    int64_t openUs = 0;             // nvs_open_from_partition
+    int64_t preloadUs = 0;          // Init key scan, including the preload if requested
+    int64_t onInitUs = 0;           // Version check, OnInit and version update
+    int64_t totalUs = 0;            // Whole Init
+    zPrefLatency commit;            // nvs_commit
+};
+#endif
+
+#if ZPREF_ENABLE_WEAR_STATS
+/**
+ * @brief Flash wear counters of a variable or a whole namespace
+ */
+struct zPrefWearStats {
+    uint32_t writes = 0;            // nvs_set calls
+    uint32_t commits = 0;           // nvs_commit calls that included a write of the variable
+    uint32_t skipped = 0;           // Writes avoided as unchanged
+    uint32_t bytes = 0;             // Flash written, in whole NVS entries
+};
+#endif
+
+/**
+ * @brief Commit rate limit of a hot variable, see zPrefVariable::SetRateLimit
+ */
+struct zPrefRateLimit {
+    uint16_t maxCommits;            // Commits allowed per window
+    uint32_t windowMs;
+    uint32_t windowStart = 0;
+    uint16_t count = 0;
+
+    zPrefRateLimit(uint16_t maxCommits, uint32_t windowMs) : maxCommits(maxCommits), windowMs(windowMs) {};
+
+    bool Allow(uint32_t nowMs) {
+        if ((count == 0) || (nowMs - windowStart >= windowMs)) {
+            windowStart = nowMs;
+            count = 0;
+        }
+        if (count >= maxCommits) {
+            return false;
+        }
+        count++;
+        return true;
+    };
+};
+
+/**
+ * @brief Flash used by one write of a value of size bytes
+ */
+inline size_t zPrefEntryBytes(size_t size) {
+    return ZPREF_NVS_ENTRY_SIZE * (1 + (size + ZPREF_NVS_ENTRY_SIZE - 1) / ZPREF_NVS_ENTRY_SIZE);
+}
+template<typename T>
+inline size_t zPrefEntryBytes(const T&) { return ZPREF_NVS_ENTRY_SIZE; }
+inline size_t zPrefEntryBytes(const String& v) { return zPrefEntryBytes((size_t)v.length() + 1); }
+template<typename E, size_t N>
+inline size_t zPrefEntryBytes(const std::array<E, N>&) { return zPrefEntryBytes(sizeof(E) * N); }
+
+/**
+ * @brief Text conversion used by FromString() and GetString()
+ *
+ * parseValue()/formatValue() of type_converter for single values; arrays are
+ * comma separated lists of their elements.
+ */
+template<typename T>
+inline eConvResult zPrefParse(const char * const val, T& out) { return parseValue<T>(val, out); }
+template<typename T>
+inline size_t zPrefFormat(const T& val, char * const buf, size_t len) { return formatValue<T>(val, buf, len); }
+
+template<typename E, size_t N>
+eConvResult zPrefParse(const char * const val, std::array<E, N>& out) {
+    if (val == nullptr) {
+        return eConvFormat;
+    }
+    std::array<E, N> parsed;
+    const char* p = val;
+    for (size_t i = 0; i < N; i++) {
+        const char* end = strchr(p, ',');
+        size_t len = (end != nullptr) ? (size_t)(end - p) : strlen(p);
+        if ((end == nullptr) != (i + 1 == N)) {
+            return eConvFormat;     // Too many or too few elements
+        }
+        char element[40];
+        if (len >= sizeof(element)) {
+            return eConvFormat;
+        }
+        memcpy(element, p, len);
+        element[len] = '\0';
+        eConvResult res = parseValue<E>(element, parsed[i]);
+        if (res != eConvOk) {
+            return res;
+        }
+        p += len + 1;
+    }
+    out = parsed;
+    return eConvOk;
+}
+
+template<typename E, size_t N>
+size_t zPrefFormat(const std::array<E, N>& val, char * const buf, size_t len) {
+    size_t pos = 0;
+    for (size_t i = 0; i < N; i++) {
+        char element[48];   // Separator and the longest formatted scalar
+        size_t n = 0;
+        if (i > 0) {
+            element[n++] = ',';
+        }
+        n += formatValue<E>(val[i], element + n, sizeof(element) - n);
+        if (pos + n < len) {
+            memcpy(buf + pos, element, n);
+        }
+        pos += n;
+    }
+    if (pos < len) {
+        buf[pos] = '\0';
+    }
+    return pos;
+}
+
+template<typename T>
+inline String zPrefToString(const T& val) { return String(val); }
+inline String zPrefToString(float val) { char buf[24]; zPrefFormat(val, buf, sizeof(buf)); return String(buf); }
+inline String zPrefToString(double val) { char buf[32]; zPrefFormat(val, buf, sizeof(buf)); return String(buf); }
+template<typename E, size_t N>
+String zPrefToString(const std::array<E, N>& val) {
+    std::vector<char> buf(zPrefFormat(val, nullptr, 0) + 1);
+    zPrefFormat(val, buf.data(), buf.size());
+    return String(buf.data());
+}
+
+/**
+ * @brief Native bytes of a value in a config delta, see zPrefBase::ComputeDelta()
+ *
+ * Scalars and arrays as in memory, Strings without the terminator.
+ * zPrefEncode returns the size, nothing is written if it exceeds len.
+ * zPrefDecode rejects a size or value the type cannot hold.
+ */
+template<typename T>
+size_t zPrefEncode(const T& val, uint8_t * const buf, size_t len) {
+    if (sizeof(T) <= len) {
+        memcpy(buf, &val, sizeof(T));
+    }
+    return sizeof(T);
+}
+inline size_t zPrefEncode(const String& val, uint8_t * const buf, size_t len) {
+    if (val.length() <= len) {
+        memcpy(buf, val.c_str(), val.length());
+    }
+    return val.length();
+}
+
+template<typename T>
+bool zPrefDecode(const uint8_t * const data, size_t len, T& out) {
+    if (len != sizeof(T)) {
+        return false;
+    }
+    memcpy(&out, data, sizeof(T));
+    return true;
+}
+inline bool zPrefDecode(const uint8_t * const data, size_t len, bool& out) {
+    if ((len != 1) || (data[0] > 1)) {
+        return false;
+    }
+    out = (data[0] != 0);
+    return true;
+}
+inline bool zPrefDecode(const uint8_t * const data, size_t len, String& out) {
+    if (memchr(data, '\0', len) != nullptr) {
+        return false;
+    }
+    std::vector<char> buf(data, data + len);
+    buf.push_back('\0');
+    out = String(buf.data());
+    return true;
+}
+
+/**
+ * @brief Value type of a variable, as recorded in the schema
+ */
+typedef enum : uint8_t {
+    eZPrefBool = 0,
+    eZPrefUChar,
+    eZPrefUShort,
+    eZPrefLong64,
+    eZPrefString,
+    eZPrefBlob,             // zPrefBlob - raw bytes in a caller buffer
+    eZPrefText,             // zPrefBlob - NUL terminated string in a caller buffer
+    eZPrefChar,
+    eZPrefShort,
+    eZPrefInt,              // Every 32-bit signed integer type
+    eZPrefUInt,             // Every 32-bit unsigned integer type
+    eZPrefULong64,
+    eZPrefFloat,            // Raw bits in a u32
+    eZPrefDouble,           // Raw bits in a u64
+    eZPrefArray,            // std::array of scalars, in a blob
+} eZPrefType;
+
+/**
+ * @brief How a String value is kept in RAM once loaded, see zPrefBase::SetCachePolicy()
+ */
+typedef enum : uint8_t {
+    eZPrefCacheAlways = 0,  // Loaded once and kept - the default
+    eZPrefCacheLru,         // Kept within the cache budget, least recently used released first
+    eZPrefCacheNone,        // Read from NVS on use, only the last read-through value is kept
+} eZPrefCachePolicy;
+
+/**
+ * @brief One schema entry per variable, generated by ZPREF_VARIABLES into flash
+ */
+struct zPrefSchemaEntry {
+    const char *    key;
+    eZPrefType      type;
+};
+
+class zPrefBase;
+class zPrefVariableBase;
+class zPrefPackedGroup;
+
+/**
+ * @brief Change callback, see zPrefBase::Subscribe()
+ */
+typedef void (*zPrefObserver)(zPrefVariableBase& var, void * ctx);
+
+/**
+ * @brief Query callback, see zPrefBase::ForEach() - return false to stop
+ */
+typedef bool (*zPrefVisitor)(zPrefVariableBase& var, void * ctx);
+
+struct zPrefSubscription {
+    zPrefVariableBase * var;        // nullptr for every variable
+    zPrefObserver       fn;
+    void *              ctx;
+};
+
+/**
+ * @brief FNV-1a hash of a key, usable at compile time
+ */
+constexpr uint32_t zPrefHash(const char * s, uint32_t h = 2166136261u) {
+    return (*s != '\0') ? zPrefHash(s + 1, (h ^ (uint8_t)*s) * 16777619u) : h;
+}
+
+/**
+ * @brief The variables of a configuration class, generated by ZPREF_VARIABLES
+ */
+struct zPrefRegistry {
+    zPrefVariableBase * const * variables;  // Declaration order
+    uint16_t *                  index;      // Positions in variables[], sorted by key
+    const zPrefSchemaEntry *    schema;     // Parallel to variables[]
+    size_t                      count;
+    uint16_t *                  hashIndex;  // Positions in variables[], sorted by zPrefHash(key) - may be nullptr
+};
+
+/**
+ * @brief Cache policy and LRU links of a String variable, see zPrefBase::SetCachePolicy()
+ *
+ * A base of zPrefVariable<String> only - every other variable derives from the
+ * empty zPrefNoCacheState instead and carries none of it.
+ */
+class zPrefCacheState {
+    friend class zPrefBase;
+    friend class zPrefVariableBase;
+
+    protected:
+        eZPrefCachePolicy _cachePolicy = eZPrefCacheAlways;
+        zPrefVariableBase* _lruPrev = nullptr;  // LRU list of the config, most recently used first
+        zPrefVariableBase* _lruNext = nullptr;
+        size_t _cachedBytes = 0;        // Heap of the cached value as accounted in the cache budget
+
+        zPrefCacheState* cacheState() { return this; };
+        eZPrefCachePolicy cachePolicy() { return _cachePolicy; };
+};
+
+class zPrefNoCacheState {
+    protected:
+        zPrefCacheState* cacheState() { return nullptr; };
+        eZPrefCachePolicy cachePolicy() { return eZPrefCacheAlways; };
+};
+
 class zPrefVariableBase {
+    friend class zPrefBase;
+    friend class zPref;
+    friend class zPrefPackedGroup;
+    friend class zPrefSnapshotBase;
+    friend class zPrefQuery;
+
     public:
-        String _key;
+        const char * const _key;    // NVS key, points to the variable name literal
+
+#if ZPREF_ENABLE_TIMING
+        zPrefLatency _readLatency;      // NVS load of the cached value
+        zPrefLatency _writeLatency;     // nvs_set, excluding the commit
+#endif
 
     protected:
-        zPrefVariableBase(String key): _key(key) {};
+#if ZPREF_ENABLE_WEAR_STATS
+        zPrefWearStats _wear;
+        bool _uncommitted = false;      // Written since the last commit
+#endif
+        zPrefRateLimit* _rateLimit = nullptr;
+        uint8_t _shard = 0;             // Namespace the variable is stored in, see zPref::AddShard
+        zPrefFlag initialized{false};   // Cached value is valid
+        bool _staged = false;   // Value changed inside a batch, not yet written to NVS
+        bool _dirty = false;    // Queued for the write-behind flush
+        bool _stored = true;    // Key may be in NVS - cleared by the Init scan when it is not
+        uint32_t _changeSeq = 0;        // zPrefBase::ChangeSequence() at the last change, 0 if unchanged since boot
+        zPrefPackedGroup* _group = nullptr;     // Stored in a packed blob instead of its own key
+
+        zPrefVariableBase(const char * const key): _key(key) {};
         virtual ~zPrefVariableBase() {};
 
+        // Batch support - called by zPrefBase on CommitBatch()/AbortBatch()
+        virtual size_t Persist() = 0;
+        virtual void Rollback() = 0;
+
+        // Fill the cached value at Init - from NVS if the key is present, else the default
+        virtual void Preload(bool present) = 0;
+
+        // Native-width image of the cached value, as stored in NVS
+        // Serialize returns the image size, nothing is written if it exceeds len
+        virtual size_t Serialize(uint8_t * const buf, size_t len) = 0;
+        virtual bool Deserialize(const uint8_t * const buf, size_t len) = 0;
+
+        // Bytes needed from the configuration arena, bound once at Init
+        virtual size_t ArenaSize() { return 0; };
+        virtual void BindArena(uint8_t * const) {};
+
+        // Heap held by the cached value, and releasing it - reloaded from NVS on next use
+        virtual size_t HeapBytes() { return 0; };
+        // Keys the value rotates over - the key followed by a hex digit, zPrefCounter only
+        virtual uint8_t CounterSlots() { return 0; };
+        virtual bool Evict() { return false; };
+        virtual zPrefCacheState* CacheState() { return nullptr; };    // String variables only
+
+        // Value in a config delta, see zPrefEncode() - Encode returns the size, nothing is written if it exceeds len
+        virtual size_t Encode(uint8_t * const buf, size_t len) = 0;
+        virtual bool Accepts(const uint8_t * const data, size_t len) = 0;
+        virtual size_t Assign(const uint8_t * const data, size_t len) = 0;
+
+        // Escaped string form of the value for Export(), scratch may be used for formatting
+        virtual size_t ExportValue(Print& out, char * const scratch, size_t len);
+
     public:
+        virtual eZPrefType Kind() = 0;
+
+#if ZPREF_ENABLE_WEAR_STATS
+        const zPrefWearStats& WearStats() { return _wear; };
+#endif
+
+        /**
+         * @brief Store the variable in another namespace, call before Init()
+         * @param shard Returned by zPref::AddShard(), 0 for the main namespace
+         */
+        void SetShard(uint8_t shard) { _shard = shard; };
+        uint8_t Shard() { return _shard; };
+
+        eZPrefCachePolicy CachePolicy() {
+            zPrefCacheState* state = CacheState();
+            return (state != nullptr) ? state->_cachePolicy : eZPrefCacheAlways;
+        };
+
         virtual size_t FromString(const char * const val) = 0;
-        virtual bool GetString(char * const buf, size_t len) = 0;
+
+        /**
+         * @brief Write the default value, see zPref::Reset() for all variables
+         */
+        virtual size_t SetDefault() = 0;
+
+        /**
+         * @brief Format the value into buf without allocating
+         * @param required Optional - receives the buffer size needed, including the NUL
+         * @return bool - true if the value fitted in buf
+         */
+        virtual bool GetString(char * const buf, size_t len, size_t * const required = nullptr) = 0;
         virtual String GetString() = 0;
 };
 
+template<typename T> struct zPrefNvs;
+template<typename T, size_t W = sizeof(T), bool S = std::is_signed<T>::value> struct zPrefNvsInteger;
+template<typename T, uint8_t N> class zPrefCounter;
+
 class zPrefBase {
+    template<typename T> friend class zPrefVariable;
+    template<typename T, uint8_t N> friend class zPrefCounter;
+    template<typename T> friend struct zPrefNvs;
+    template<typename T, size_t W, bool S> friend struct zPrefNvsInteger;
+    friend class zPrefPackedGroup;
+    friend class zPrefSnapshotBase;
+    friend class zPrefBlob;
+    friend class zPrefShardScope;
+    friend class zPrefQuery;
+
     public:
-        virtual nvs_handle_t& nvs_handle() = 0;
+        /**
+         * @brief Storage of a shard, the main namespace for 0 or an unknown shard
+         */
+        virtual zPrefStorage& storage(uint8_t shard) = 0;
+
+        /**
+         * @brief Storage the nvs_get/nvs_put helpers use - the shard of the
+         * variable being loaded or written, else the main namespace
+         */
+        zPrefStorage& storage() { return storage(_activeShard); };
 
     protected:
+        uint8_t _activeShard = 0;       // Set by zPrefShardScope
+        uint8_t _writtenShards = 0;     // Shards other than 0 with uncommitted writes, as a bitmask
+
+        void touchShard(uint8_t shard) { _writtenShards |= (uint8_t)(1u << shard); };
+
         void commit();
+        void stage(zPrefVariableBase* var);
+        void markDirty(zPrefVariableBase* var);
+        void clearDirty(zPrefVariableBase* var);
+        void queueCounter(zPrefVariableBase* var) { _pendingCounters.push_back(var); };
+        bool readCounterSlot(zPrefVariableBase* var, uint8_t slot, nvs_type_t type, void* val);
+        size_t writeCounterSlot(zPrefVariableBase* var, uint8_t slot, nvs_type_t type, const void* val, size_t len);
+        virtual void writeBehindNotify() {};
+        virtual void batchPersisted() {};  // Staged values written, before the batch commit
+        virtual size_t journalRecords(Print&) { return 0; };   // Lines journaled besides the staged values
+        bool writeJournal();
+        bool importLine(char* line);
+        void notify(zPrefVariableBase* var);
+        void cacheUsed(zPrefVariableBase* var);
+        void cacheUnlink(zPrefVariableBase* var);
+        void trimCache(zPrefVariableBase* keep);
+#if ZPREF_ENABLE_WEAR_STATS
+        void countWrite(zPrefVariableBase* var, size_t bytes);
+        void countSkipped(zPrefVariableBase* var);
+#else
+        void countWrite(zPrefVariableBase*, size_t) {};
+        void countSkipped(zPrefVariableBase*) {};
+#endif
 
         // NVS helper methods for different data types
         bool nvs_getBool(const char* key, bool default_value);
@@ -80,7 +603,8 @@ class zPrefBase {
         uint32_t nvs_getULong(const char* key, uint32_t default_value);
         int64_t nvs_getLong64(const char* key, int64_t default_value);
         uint64_t nvs_getULong64(const char* key, uint64_t default_value);
-        String nvs_getString(const char* key, String default_value);
+        String nvs_getString(const char* key, const char* default_value);
+        size_t nvs_getBlob(const char* key, void* buf, size_t len);
 
         size_t nvs_putBool(const char* key, bool value);
         size_t nvs_putChar(const char* key, int8_t value);
@@ -93,124 +617,1616 @@ class zPrefBase {
         size_t nvs_putULong(const char* key, uint32_t value);
         size_t nvs_putLong64(const char* key, int64_t value);
         size_t nvs_putULong64(const char* key, uint64_t value);
-        size_t nvs_putString(const char* key, String value);
+        size_t nvs_putString(const char* key, const String& value);
+        size_t nvs_putBlob(const char* key, const void* buf, size_t len);
 
     public:
-        void AddVariable(shared_ptr<zPrefVariableBase> var) {
-            _variables.push_back(var);
-        };
+        /**
+         * @brief Look up a variable by its NVS key
+         * @param key NVS key (variable name)
+         * @return zPrefVariableBase* - the variable, nullptr if not found
+         *
+         * Binary search over the key index, no allocations.
+         */
+        zPrefVariableBase* Find(const char * const key);
+
+        /**
+         * @brief Look up a variable by zPrefHash() of its key
+         * @return zPrefVariableBase* - the variable, nullptr if not found
+         */
+        zPrefVariableBase* FindHash(uint32_t hash);
+
+        /**
+         * @brief Number of variables declared with ZPREF_VARIABLES
+         */
+        size_t VariableCount() { return Registry().count; };
+
+        /**
+         * @brief Variable by position, in declaration order
+         */
+        zPrefVariableBase* Variable(size_t i) { return Registry().variables[i]; };
+
+        /**
+         * @brief Schema entry by position, in declaration order
+         */
+        const zPrefSchemaEntry& Schema(size_t i) { return Registry().schema[i]; };
+
         String GetString(String key) {
-            for (auto var : _variables) {
-                if (key.equals(var->_key)) {
-                    return var->GetString();
-                }
-            }
-            return "";
+            zPrefVariableBase* var = Find(key.c_str());
+            return var ? var->GetString() : "";
         };
-        bool GetString(const char * const key, char * const buf, size_t len) {
-            for (auto var : _variables) {
-                if (String(key).equals(var->_key)) {
-                    return var->GetString(buf, len);
-                }
-            }
-            return false;
+        bool GetString(const char * const key, char * const buf, size_t len, size_t * const required = nullptr) {
+            zPrefVariableBase* var = Find(key);
+            return var ? var->GetString(buf, len, required) : false;
         };
         size_t Set(const char * const key, const char * const val) {
-            for (auto var : _variables) {
-                if (String(key).equals(var->_key)) {
-                    return var->FromString(val);
-                }
-            }
-            return 0;
+            zPrefVariableBase* var = Find(key);
+            return var ? var->FromString(val) : 0;
         };
         size_t Set(String key, String val) {
             return Set(key.c_str(), val.c_str());
         };
 
+        /**
+         * @brief Start a batch of writes
+         *
+         * Until the matching CommitBatch(), Set() only updates the cached
+         * values and records the variable as staged. CommitBatch() then
+         * writes all staged variables and issues a single nvs_commit.
+         * Batches may be nested - only the outermost CommitBatch() writes.
+         */
+        void BeginBatch();
+
+        /**
+         * @brief Write all staged variables and commit once
+         * @return size_t - total bytes written, 0 if nothing was written
+         */
+        size_t CommitBatch();
+
+        /**
+         * @brief Drop all staged writes and restore the cached values
+         *
+         * Aborts the whole batch, including any enclosing BeginBatch() levels.
+         */
+        void AbortBatch();
+
+        bool InBatch() { return _batchDepth > 0; };
+
+        /**
+         * @brief Make batches of more than one key power-fail safe
+         * @param enable true to journal every batch
+         *
+         * CommitBatch() first writes the staged values as key=value lines into
+         * the ZPREF_JOURNAL_KEY blob and commits it, then writes the values and
+         * commits, then erases the journal. A journal left by a power loss is
+         * replayed by the next Init(), so either all or none of the batch is
+         * applied. Costs the journal blob and two extra commits per batch;
+         * single-key batches and write-behind flushes are not journaled. A
+         * journal over ZPREF_JOURNAL_MAX bytes is dropped with a warning and
+         * the batch is committed unjournaled. Version migrations in Init() are
+         * journaled within the same limit.
+         */
+        void SetJournal(bool enable) { _journaled = enable; };
+
+        /**
+         * @brief Skip the NVS write when Set() is called with the cached value
+         * @param enable true to compare against the cached value before writing
+         */
+        void SetWriteElision(bool enable) { _writeElision = enable; };
+
+        /**
+         * @brief Number of writes skipped by write elision
+         */
+        uint32_t SkippedWrites() { return _skippedWrites; };
+
+#if ZPREF_ENABLE_WEAR_STATS
+        /**
+         * @brief Wear counters of all variables together, requires ZPREF_ENABLE_WEAR_STATS
+         * commits counts every nvs_commit issued
+         */
+        const zPrefWearStats& WearStats() { return _wear; };
+#endif
+
+        /**
+         * @brief Write every variable as a key=value line
+         * @return Number of variables written
+         *
+         * Values use the string interface, with backslash, CR and LF escaped
+         * as \\, \r and \n. Formatting uses a ZPREF_LINE_MAX stack buffer,
+         * only longer String values are copied to the heap.
+         */
+        size_t Export(Print& out);
+
+        /**
+         * @brief Apply key=value lines written by Export() as a single batch
+         * @return Number of variables set
+         *
+         * Blank lines and lines starting with # are ignored. Unknown keys,
+         * malformed values and lines longer than ZPREF_LINE_MAX - 2 are logged
+         * and skipped. All values are written with one commit at the end.
+         */
+        size_t Import(Stream& in);
+
+        /**
+         * @brief Choose how long a String value stays in RAM once loaded
+         * @param var Variable to change, or every String variable with the overload without it
+         * @return eStatus - eFAILED for a variable that is not a String
+         *
+         * eZPrefCacheAlways keeps the value loaded, as by default.
+         * eZPrefCacheLru keeps values within SetCacheBudget() and releases the
+         * least recently used first. eZPrefCacheNone reads the value from NVS
+         * on use and keeps only the last value read, of any such variable;
+         * GetString(buf, len) then reads straight into buf without a String.
+         * Values staged in a batch or queued for write-behind are never
+         * released. Variables with these policies are not preloaded by Init().
+         * A reference from Get() is only valid until the value is released -
+         * copy it if it has to outlive the next access of another variable.
+         */
+        eStatus SetCachePolicy(zPrefVariableBase * var, eZPrefCachePolicy policy);
+        void SetCachePolicy(eZPrefCachePolicy policy);
+
+        /**
+         * @brief Bytes of eZPrefCacheLru values kept in RAM, ZPREF_CACHE_BUDGET by default
+         *
+         * The most recently used value is always kept, even when it alone
+         * exceeds the budget.
+         */
+        void SetCacheBudget(size_t bytes);
+        size_t CacheUsed() { return _cacheUsed; };
+
+        /**
+         * @brief Counter bumped by every change of a variable, 0 after boot
+         *
+         * Pass a value taken earlier to ComputeDelta() to get what changed since.
+         * Kept in RAM only - after a reboot every variable counts as unchanged.
+         */
+        uint32_t ChangeSequence() { return _changeSequence; };
+
+        /**
+         * @brief Encode the variables changed after sequence since as a binary delta
+         * @param since ChangeSequence() of the last sync, 0 for every variable changed since boot
+         * @param buf Output buffer - may be nullptr with len 0 to get the size
+         * @return size_t - bytes needed, nothing is written if it exceeds len
+         *
+         * Header: u16 ZPREF_DELTA_MAGIC, u8 format version, u8 reserved, u16
+         * entry count, u32 ChangeSequence() at encoding. Each entry: u32
+         * zPrefHash() of the key, u8 eZPrefType, u16 length and the native
+         * value bytes, see zPrefEncode(). Trailer: u32 FNV-1a of all preceding
+         * bytes. All fields little endian. The size scales with the changed
+         * variables only.
+         */
+        size_t ComputeDelta(uint32_t since, uint8_t * const buf, size_t len);
+
+        /**
+         * @brief Validate a delta from ComputeDelta() and apply it as one batch
+         * @return eStatus - eFAILED and nothing applied if any entry is malformed,
+         *         unknown, of another type or does not fit the variable
+         *
+         * Values are assigned without any string parsing and written with a
+         * single commit, journaled when SetJournal() is enabled.
+         */
+        eStatus ApplyDelta(const uint8_t * const buf, size_t len);
+
+        /**
+         * @brief Call fn for every variable whose key matches pattern, in key order
+         * @param pattern Key, or glob with * and ? - nullptr or "*" for all
+         * @return Number of variables visited
+         *
+         * Uses the sorted key index: the part of the pattern before the first
+         * wildcard selects the range with a binary search, so "Wifi*" costs
+         * O(log n + k) for k matches. No allocations.
+         */
+        size_t ForEach(const char * const pattern, zPrefVisitor fn, void * ctx = nullptr);
+
+        /**
+         * @brief Write the variables matching pattern as key=value lines, in key order
+         * @return Number of variables written
+         */
+        size_t Export(Print& out, const char * const pattern);
+
+        /**
+         * @brief Call fn(var, ctx) whenever a variable changes
+         * @param key Variable to observe, nullptr or "*" for every variable
+         * @return eStatus - eFAILED if the key is unknown
+         *
+         * Callbacks run in the task that set the value, right after Set() or
+         * FromString(), with the write lock held - keep them short and do not
+         * subscribe or unsubscribe from inside one. Unchanged values skipped
+         * by write elision do not notify. A batch notifies once per changed
+         * variable on CommitBatch() and not at all on AbortBatch(). Dispatch
+         * walks the subscriptions, not the variables.
+         */
+        eStatus Subscribe(const char * const key, zPrefObserver fn, void * ctx = nullptr);
+        eStatus Subscribe(zPrefVariableBase * var, zPrefObserver fn, void * ctx = nullptr);
+
+        /**
+         * @brief Remove every subscription of fn with ctx
+         */
+        void Unsubscribe(zPrefObserver fn, void * ctx = nullptr);
+
+        /**
+         * @brief Provide the storage for arena-backed variables, call before Init()
+         * @return eStatus - eFAILED if the arena is already bound
+         *
+         * Without an explicit buffer Init() allocates one block of exactly the
+         * size the declared zPrefArenaTextOf/zPrefArenaBlobOf variables need.
+         */
+        eStatus SetArena(void * buffer, size_t size);
+
+        /**
+         * @brief Arena statistics - size, bytes reserved by variables and the
+         * peak number of bytes held by their values at the same time
+         */
+        size_t ArenaCapacity() { return _arenaCapacity; };
+        size_t ArenaUsed() { return _arenaUsed; };
+        size_t ArenaHighWater() { return _arenaHighWater; };
+
+        virtual ~zPrefBase();
+
+        /**
+         * @brief Write all variables queued by write-behind or a rate limit,
+         * and every zPrefCounter not yet persisted, and commit once
+         * @return size_t - total bytes written, 0 if nothing was queued
+         *
+         * The queues are taken under the write lock and written without it, so
+         * Set() in write-behind mode does not wait for the NVS writes and commit.
+         */
+        size_t Flush();
 
     protected:
-        std::vector<shared_ptr<zPrefVariableBase>> _variables;
+        // Overridden by ZPREF_VARIABLES, nothing registered otherwise
+        virtual zPrefRegistry registry() { return zPrefRegistry{nullptr, nullptr, nullptr, 0, nullptr}; };
+
+        // Fetched and indexed on first use - the derived class is not constructed yet in our constructor
+        const zPrefRegistry& Registry() {
+            if (!_indexed) buildIndex();
+            return _registry;
+        };
+        void buildIndex();
+
+        eStatus bindArena();
+        eStatus checkCounterKeys();
+        void arenaResize(size_t from, size_t to);
+
+        zPrefRegistry _registry{};
+        bool _indexed = false;
+        std::vector<zPrefVariableBase*> _stagedVariables;
+        std::vector<zPrefVariableBase*> _dirtyVariables;   // Write-behind queue
+        std::vector<zPrefVariableBase*> _pendingCounters;  // zPrefCounter values ahead of NVS
+        size_t _dirtyCapacity = 0;
+        bool _writeBehind = false;
+        uint8_t _batchDepth = 0;
+        bool _commitPending = false;
+        bool _writeElision = false;
+        bool _journaled = false;
+        uint32_t _skippedWrites = 0;
+        uint32_t _changeSequence = 0;
+        zPrefVariableBase* _lruHead = nullptr;
+        zPrefVariableBase* _lruTail = nullptr;
+        zPrefVariableBase* _readThrough = nullptr;  // Last eZPrefCacheNone value loaded
+        size_t _cacheBudget = ZPREF_CACHE_BUDGET;
+        size_t _cacheUsed = 0;
+        uint8_t* _arena = nullptr;
+        size_t _arenaCapacity = 0;
+        size_t _arenaUsed = 0;
+        size_t _arenaInUse = 0;
+        size_t _arenaHighWater = 0;
+        bool _arenaOwned = false;           // Allocated by bindArena()
+        std::vector<zPrefSubscription> _subscriptions;
+#if ZPREF_ENABLE_WEAR_STATS
+        zPrefWearStats _wear;
+        std::vector<zPrefVariableBase*> _uncommittedVariables;
+#endif
+#if ZPREF_ENABLE_TIMING
+        zPrefTiming _timing;
+#endif
+#if ZPREF_THREAD_SAFE
+        std::recursive_mutex _writeLock;    // Serializes changes of the cached values, batches and lazy loads
+        std::recursive_mutex _storageLock;  // Serializes NVS access, taken after _writeLock
+        std::mutex _valueLock;              // Guards in-RAM copies of non-scalar cached values
+#endif
 };
 
+/**
+ * @brief Scope guard for a batch of writes
+ *
+ * Commits on destruction unless Commit() or Abort() was called explicitly.
+ *
+ * Example:
+ * @code
+ * {
+ *     zPrefBatch batch(Config);
+ *     Config.DeviceName = String("Provisioned");
+ *     Config.ServerPort = 9090;
+ * }   // Single nvs_commit here
+ * @endcode
+ */
+class zPrefBatch {
+    private:
+        zPrefBase&  _config;
+        bool        _done = false;
+
+    public:
+        zPrefBatch(zPrefBase& config) : _config(config) { _config.BeginBatch(); };
+        ~zPrefBatch() { if (!_done) _config.CommitBatch(); };
+        zPrefBatch(const zPrefBatch&) = delete;
+        zPrefBatch& operator=(const zPrefBatch&) = delete;
+
+        size_t Commit() { _done = true; return _config.CommitBatch(); };
+        void Abort() { _done = true; _config.AbortBatch(); };
+};
+
+/**
+ * @brief Directs the nvs_get/nvs_put helpers to a shard for the scope's lifetime
+ */
+class zPrefShardScope {
+    private:
+        zPrefBase&  _config;
+        uint8_t     _previous;
+
+    public:
+        zPrefShardScope(zPrefBase& config, uint8_t shard) : _config(config), _previous(config._activeShard) {
+            _config._activeShard = shard;
+        };
+        ~zPrefShardScope() { _config._activeShard = _previous; };
+        zPrefShardScope(const zPrefShardScope&) = delete;
+        zPrefShardScope& operator=(const zPrefShardScope&) = delete;
+};
+
+/**
+ * @brief Cursor over the variables whose key matches a pattern, in key order
+ *
+ * Holds no lock between calls - values may change while a query is read, the
+ * set of variables does not.
+ *
+ * Example:
+ * @code
+ * zPrefQuery query(Config, "Wifi*");
+ * char buf[128];
+ * while (query.Read(buf, sizeof(buf)) > 0) {
+ *     shell.print(buf);
+ * }
+ * @endcode
+ */
+class zPrefQuery {
+    private:
+        zPrefBase&          _config;
+        const char * const  _pattern;       // nullptr for all
+        size_t              _prefixLen;     // Literal part of the pattern
+        bool                _glob;
+        const uint16_t *    _pos;           // Next match in the key index
+        const uint16_t *    _end;
+
+        void advance(bool skipCurrent);
+
+    public:
+        /**
+         * @param pattern Key, or glob with * and ? - nullptr or "*" for all. Must
+         *        outlive the query
+         */
+        zPrefQuery(zPrefBase& config, const char * const pattern = nullptr);
+
+        /**
+         * @brief Next matching variable, nullptr when done
+         */
+        zPrefVariableBase* Next();
+
+        bool Done() { return _pos == _end; };
+
+        /**
+         * @brief Format the following matches into buf as key=value lines, as Export()
+         * @return Bytes written excluding the NUL, 0 when done
+         *
+         * Only complete lines are written, the next call continues with the
+         * first line that did not fit. A line longer than the whole buffer is
+         * truncated to fit, without its newline.
+         */
+        size_t Read(char * const buf, size_t len);
+
+        zPrefQuery(const zPrefQuery&) = delete;
+        zPrefQuery& operator=(const zPrefQuery&) = delete;
+};
+
+/**
+ * @brief How a variable holds its default - by value, String defaults as a
+ * pointer to the CONFIG_DEFAULT_ literal, which stays in flash
+ */
 template<typename T>
-class zPrefVariable : public zPrefVariableBase
+struct zPrefDefault {
+    typedef T type;
+};
+
+template<>
+struct zPrefDefault<String> {
+    typedef const char * type;
+};
+
+// Only String values have a cache policy
+template<typename T>
+struct zPrefCacheFor {
+    typedef zPrefNoCacheState type;
+};
+
+template<>
+struct zPrefCacheFor<String> {
+    typedef zPrefCacheState type;
+};
+
+template<typename T>
+class zPrefVariable : public zPrefVariableBase, protected zPrefCacheFor<T>::type
 {
+    public:
+#if ZPREF_THREAD_SAFE
+        typedef T           get_type;   // A copy - another task may change the value at any time
+#else
+        typedef const T&    get_type;
+#endif
+
     private:
+        zPrefBase&          _config;
         T                   _current;
-        bool                initialized = false;
-        const T             _default;
-        std::function<T(String, T)>        _getter;
-        std::function<size_t(String, T)>   _setter;
-        void initialize() {
-            _current = this->_getter(_key, _default);
+        const typename zPrefDefault<T>::type _default;
+
+        // Cached state before the first staged Set() of a batch
+        T                   _rollback;
+        bool                _rollbackInitialized = false;
+
+#if ZPREF_THREAD_SAFE
+        // Scalars are read lock-free through a seqlock, odd while a write is in progress
+        std::atomic<uint32_t> _seq{0};
+
+        T load(std::true_type) {
+            T val;
+            uint32_t seq;
+            do {
+                seq = _seq.load(std::memory_order_acquire);
+                val = _current;
+                std::atomic_thread_fence(std::memory_order_acquire);
+            } while ((seq & 1) || (seq != _seq.load(std::memory_order_relaxed)));
+            return val;
+        }
+        T load(std::false_type) {
+            std::lock_guard<std::mutex> guard(_config._valueLock);
+            return _current;
+        }
+        void store(const T& val, std::true_type) {
+            _seq.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            _current = val;
+            _seq.fetch_add(1, std::memory_order_release);
+        }
+        void store(const T& val, std::false_type) {
+            std::lock_guard<std::mutex> guard(_config._valueLock);
+            _current = val;
+        }
+        T cached() { return load(typename std::is_scalar<T>::type()); }
+        void cache(const T& val) { store(val, typename std::is_scalar<T>::type()); }
+#else
+        const T& cached() { return _current; }
+        void cache(const T& val) { _current = val; }
+#endif
+
+        // Scalars are stored in NVS as their native bytes
+        size_t serialize(uint8_t * const buf, size_t len, std::true_type) {
+            T val = cached();
+            if (sizeof(T) <= len) {
+                memcpy(buf, &val, sizeof(T));
+            }
+            return sizeof(T);
+        }
+        bool deserialize(const uint8_t * const buf, size_t len, std::true_type) {
+            if (len != sizeof(T)) {
+                return false;
+            }
+            T val;
+            memcpy(&val, buf, sizeof(T));
+            cache(val);
             initialized = true;
+            return true;
         }
+        size_t serialize(uint8_t * const, size_t, std::false_type) { return 0; }
+        bool deserialize(const uint8_t * const, size_t, std::false_type) { return false; }
+
+        void initialize();
+        size_t write(const T& val);
+
+        // Only String values are worth releasing
+        size_t heapBytes(std::true_type) { return _current.length() + 1; }
+        size_t heapBytes(std::false_type) { return 0; }
+
+        // Read-through String straight from NVS into buf, false to format the loaded value instead
+        bool readThrough(char * const buf, size_t len, size_t * const required, bool& fitted, std::true_type) {
+            ZPREF_LOCK_WRITES(_config);
+            if (initialized || !_stored || (_group != nullptr)) {
+                return false;
+            }
+            size_t size = 0;
+            zPrefStorage& storage = _config.storage(_shard);
+            if ((storage.Get(_key, NVS_TYPE_STR, nullptr, &size) != ESP_OK) || (size == 0)) {
+                return false;   // Not stored after all or unreadable - the load handles it
+            }
+            if (required) {
+                *required = size;
+            }
+            fitted = (size <= len) && (storage.Get(_key, NVS_TYPE_STR, buf, &size) == ESP_OK);
+            return true;
+        }
+        bool readThrough(char * const, size_t, size_t * const, bool&, std::false_type) { return false; }
+
+    protected:
+        size_t Persist() {
+            return write(cached());     // Called by Flush() without the write lock
+        };
+        void Rollback() {
+            cache(_rollback);
+            initialized = _rollbackInitialized;
+        };
+        void Preload(bool present) {
+            if (this->cachePolicy() != eZPrefCacheAlways) {
+                return;         // Loaded on first use
+            }
+            if (present) {
+                initialize();
+            } else {
+                cache(T(_default));
+                initialized = true;
+            }
+        };
+        size_t Serialize(uint8_t * const buf, size_t len) {
+            return serialize(buf, len, typename std::is_scalar<T>::type());
+        };
+        bool Deserialize(const uint8_t * const buf, size_t len) {
+            return deserialize(buf, len, typename std::is_scalar<T>::type());
+        };
+        size_t Encode(uint8_t * const buf, size_t len) {
+            return zPrefEncode(this->Get(), buf, len);
+        };
+        size_t HeapBytes() {
+            return heapBytes(typename std::is_same<T, String>::type());
+        };
+        zPrefCacheState* CacheState() {
+            return this->cacheState();
+        };
+        bool Evict() {
+            if (_staged || _dirty || !initialized) {
+                return false;
+            }
+            cache(T());
+            initialized = false;
+            return true;
+        };
+        bool Accepts(const uint8_t * const data, size_t len) {
+            T val;
+            return zPrefDecode(data, len, val);
+        };
+        size_t Assign(const uint8_t * const data, size_t len) {
+            T val;
+            return zPrefDecode(data, len, val) ? this->Set(val) : 0;
+        };
 
     public:
+        /**
+         * @param defaultVal Default value - for String variables a string literal,
+         *        referenced in place rather than copied
+         */
         zPrefVariable(
-            const char * key,
-            T defaultVal,
-            zPrefBase& config,
-            std::function<T(String, T)> g,
-            std::function<size_t(String, T)> s):
+            const char * const key,
+            const typename zPrefDefault<T>::type& defaultVal,
+            zPrefBase& config):
                 zPrefVariableBase(key),
+                _config(config),
+                _current(),     // Set from _default on first load, a String default costs no heap until then
                 _default(defaultVal),
-                _getter(g),
-                _setter(s) {
-                    config.AddVariable(shared_ptr<zPrefVariableBase>(this));
-            };
-        const T& operator()() { return Get(); };
-        size_t operator=(T val) { return Set(val); };
-        const T& Get() {
+                _rollback() {};
+        eZPrefType Kind() { return zPrefNvs<T>::kind; };
+        get_type operator()() { return Get(); };
+        size_t operator=(const T& val) { return Set(val); };
+
+        /**
+         * @brief Get the cached value, loading it from NVS on first use
+         *
+         * With ZPREF_THREAD_SAFE, scalar reads are lock-free and never wait for
+         * a write or commit in progress, and non-scalar values (String) are
+         * returned as a copy taken under a short in-RAM lock.
+         * See zPrefBase::SetCachePolicy() for values that are not kept loaded.
+         */
+        get_type Get() {
+            if (this->cachePolicy() != eZPrefCacheAlways) {
+                // Under the lock - the value may be released by another task
+                ZPREF_LOCK_WRITES(_config);
+                if (!initialized) initialize();
+                _config.cacheUsed(this);
+                return cached();
+            }
             if (!initialized) initialize();
-            return _current;
+            return cached();
         };
-        size_t Set(T val) {
-            size_t ret = this->_setter(_key, val);
-            _current = val; // Unconditionally update the current value even if setting it in NVS fails
+        size_t Set(const T& val) {
+            ZPREF_LOCK_STATE(_config);
+            size_t ret = update(val);
+            if (this->cachePolicy() != eZPrefCacheAlways) {
+                ZPREF_LOCK_STORAGE(_config);    // Released values are reloaded from NVS
+                _config.cacheUsed(this);
+            }
             return ret;
         };
         size_t SetDefault() {
-            return this->_setter(_key, _default);
+            return Set(T(_default));
+        };
+        eStatus Subscribe(zPrefObserver fn, void * ctx = nullptr) {
+            return _config.Subscribe(this, fn, ctx);
+        };
+        eStatus SetCachePolicy(eZPrefCachePolicy policy) {
+            static_assert(std::is_same<T, String>::value, "zPref: only String variables have a cache policy");
+            return _config.SetCachePolicy(this, policy);
         };
+
+        /**
+         * @brief Cap the commits caused by this variable, nullptr to remove the cap
+         * @param limit Budget of commits per time window, must outlive the variable
+         *
+         * Set() beyond the budget only updates the cached value and queues the
+         * variable; the latest value is written by the first Set() in the next
+         * window, or by Flush() and End(). Batches and write-behind are not limited.
+         */
+        void SetRateLimit(zPrefRateLimit * limit) { _rateLimit = limit; };
         size_t FromString(const char * const val) {
-            return this->Set(getValue_as<T>(val));
+            // Leave the variable untouched on malformed or out of range input
+            T parsed = T();
+            if (zPrefParse(val, parsed) != eConvOk) {
+                return 0;
+            }
+            return this->Set(parsed);
         };
         String GetString() {
-            return String(this->Get());
+            return zPrefToString(this->Get());
         };
-        bool GetString(char * const buf, size_t len) {
-            String val = String(this->Get());
-            if (val.length() > len) {
-                return false;
+        bool GetString(char * const buf, size_t len, size_t * const required = nullptr) {
+            bool fitted;
+            if ((this->cachePolicy() == eZPrefCacheNone) &&
+                readThrough(buf, len, required, fitted, typename std::is_same<T, String>::type())) {
+                return fitted;
             }
-            val.toCharArray(buf, len);
-            return true;
+            size_t needed = zPrefFormat(this->Get(), buf, len);
+            if (required) {
+                *required = needed + 1;
+            }
+            return needed < len;
+        };
+
+    private:
+        size_t update(const T& val) {
+            ZPREF_LOCK_STATE(_config);
+            if (_config._writeElision && (this->Get() == val)) {
+                // Unchanged - nothing to write, report the value as accepted
+                _config._skippedWrites++;
+                _config.countSkipped(this);
+                return 1;
+            }
+            if (_config.InBatch()) {
+                // Deferred until CommitBatch(), report the value as accepted
+                if (!_staged) {
+                    _rollback = _current;
+                    _rollbackInitialized = initialized;
+                    _config.stage(this);
+                }
+                cache(val);
+                initialized = true;
+                return 1;
+            }
+            if (_config._writeBehind) {
+                // Written by the write-behind task, report the value as accepted
+                cache(val);
+                initialized = true;
+                _config.markDirty(this);
+                _config.notify(this);
+                return 1;
+            }
+            if ((_rateLimit != nullptr) && !_rateLimit->Allow(millis())) {
+                // Over the commit budget - written by a later Set(), Flush() or End()
+                cache(val);
+                initialized = true;
+                _config.markDirty(this);
+                _config.notify(this);
+                return 1;
+            }
+            cache(val); // Unconditionally update the current value even if setting it in NVS fails
+            initialized = true;
+            if (_dirty) {
+                _config.clearDirty(this);   // Queued by the rate limit, superseded by this write
+            }
+            size_t ret;
+            {
+                ZPREF_LOCK_STORAGE(_config);
+                ret = write(val);
+                _config.commit();
+            }
+            _config.notify(this);
+            return ret;
+        };
+};
+
+/**
+ * @brief A group of small scalar variables stored in a single NVS blob
+ *
+ * Declared with ZPREF_PACKED_GROUP. Loading any member reads the blob once and
+ * fills every member; writing a member rewrites the blob, and is skipped when
+ * the packed image did not change. All members must be in the same shard.
+ * The image starts with a header holding the
+ * layout version, member count and a hash of the member keys and types - a
+ * blob with a different layout is ignored and the members use their defaults.
+ * Bools are bit-packed, integers follow naturally aligned, widest first.
+ */
+class zPrefPackedGroup {
+    template<typename T> friend class zPrefVariable;
+    friend class zPrefBase;
+    friend class zPref;
+
+    private:
+        const char * const          _key;
+        const uint8_t               _version;
+        zPrefBase&                  _config;
+        zPrefVariableBase * const * _members;
+        const uint16_t              _count;
+        uint8_t * const             _image;         // Last image read from or written to NVS
+        const size_t                _imageSize;
+        bool                        _imageValid = false;
+
+        uint32_t layoutHash();
+        size_t pack(bool& changed);
+
+    protected:
+        void Load();
+        void Prepare();     // Loads the members not loaded yet, which Write() packs
+        size_t Write(zPrefVariableBase * const member);   // member - the variable that changed
+
+    public:
+        static const size_t kHeaderSize = 8;
+
+        zPrefPackedGroup(const char * const key, uint8_t version, zPrefBase& config,
+            zPrefVariableBase * const * members, uint16_t count, uint8_t * const image, size_t imageSize);
+        zPrefPackedGroup(const zPrefPackedGroup&) = delete;
+        zPrefPackedGroup& operator=(const zPrefPackedGroup&) = delete;
+};
+
+/**
+ * @brief Double-buffered copy of a set of scalar variables, see ZPREF_SNAPSHOT
+ *
+ * Writers refill the inactive buffer from the cached values when a member
+ * changes - once per member after a batch, so a batch is never seen half
+ * applied - and publish it by swapping the active index. Readers pin the
+ * active buffer with a reader count; a writer waits for the readers of the
+ * buffer it is about to refill, so it must not be pinned by the writing task.
+ */
+class zPrefSnapshotBase {
+    private:
+        zPrefBase&                  _config;
+        zPrefVariableBase * const * _members;
+        const size_t * const        _offsets;       // Of each member in the values struct
+        const uint16_t              _count;
+        uint8_t * const             _buffers[2];
+#if ZPREF_THREAD_SAFE
+        std::atomic<uint8_t>        _active{0};
+        std::atomic<uint16_t>       _readers[2];
+        std::atomic<uint32_t>       _generation{0};
+#else
+        uint8_t                     _active = 0;
+        uint32_t                    _generation = 0;
+#endif
+
+        static void onChange(zPrefVariableBase& var, void * ctx);
+
+    protected:
+        zPrefSnapshotBase(zPrefBase& config, zPrefVariableBase * const * members,
+            const size_t * offsets, uint16_t count, uint8_t * const first, uint8_t * const second);
+        ~zPrefSnapshotBase();
+
+        const uint8_t * acquire(uint8_t& buffer);
+        void release(uint8_t buffer);
+
+    public:
+        /**
+         * @brief Publish the current values, done automatically on every change
+         */
+        void Refresh();
+
+        /**
+         * @brief Number of snapshots published, changes whenever the values may have
+         */
+        uint32_t Generation() { return _generation; };
+
+        zPrefSnapshotBase(const zPrefSnapshotBase&) = delete;
+        zPrefSnapshotBase& operator=(const zPrefSnapshotBase&) = delete;
+};
+
+/**
+ * @brief Snapshot of the variables in the values struct V, declared with ZPREF_SNAPSHOT
+ *
+ * Example:
+ * @code
+ * {
+ *     MyConfig::TuningSnapshot::Reader tuning(Config.Tuning);
+ *     output = tuning->Kp * error + tuning->Ki * integral;
+ * }   // Released here
+ * @endcode
+ */
+template<typename V>
+class zPrefSnapshot : public zPrefSnapshotBase {
+    private:
+        V _values[2] = {};
+
+    public:
+        zPrefSnapshot(zPrefBase& config, zPrefVariableBase * const * members, const size_t * offsets, uint16_t count) :
+            zPrefSnapshotBase(config, members, offsets, count, (uint8_t*)&_values[0], (uint8_t*)&_values[1]) {};
+
+        /**
+         * @brief Pins the current snapshot for the reader's lifetime - keep it short
+         */
+        class Reader {
+            private:
+                zPrefSnapshot&  _snapshot;
+                uint8_t         _buffer;
+                const V *       _values;
+
+            public:
+                Reader(zPrefSnapshot& snapshot) : _snapshot(snapshot),
+                    _values((const V*)snapshot.acquire(_buffer)) {};
+                ~Reader() { _snapshot.release(_buffer); };
+                Reader(const Reader&) = delete;
+                Reader& operator=(const Reader&) = delete;
+
+                const V& operator*() const { return *_values; };
+                const V* operator->() const { return _values; };
+        };
+
+        /**
+         * @brief Copy of the current snapshot
+         */
+        V Get() {
+            Reader reader(*this);
+            return *reader;
+        };
+};
+
+/**
+ * @brief Compile-time dispatch of a value type to its NVS accessors
+ *
+ * Specialize get() and put() to make a type declarable. put() only writes -
+ * zPrefVariable commits, or defers the commit in a batch. kind is recorded
+ * in the schema. Types that can be members of a ZPREF_PACKED_GROUP also
+ * define packedBits, their width in the packed image.
+ */
+template<typename T>
+struct zPrefNvs;
+
+template<>
+struct zPrefNvs<Bool> {
+    static const uint8_t packedBits = 1;
+    static const eZPrefType kind = eZPrefBool;
+    static Bool get(zPrefBase& c, const char* k, const Bool& d) { return c.nvs_getBool(k, d); };
+    static size_t put(zPrefBase& c, const char* k, const Bool& v) { return c.nvs_putBool(k, v); };
+};
+
+template<>
+struct zPrefNvs<String> {
+    static const eZPrefType kind = eZPrefString;
+    static String get(zPrefBase& c, const char* k, const char* d) { return c.nvs_getString(k, d); };
+    static size_t put(zPrefBase& c, const char* k, const String& v) { return c.nvs_putString(k, v); };
+};
+
+// Integer types by width and signedness. Every fundamental integer type is
+// specialized once, so UChar, Long64, int32_t and the other typedefs resolve
+// whichever fundamental type the toolchain defines them as
+template<typename T>
+struct zPrefNvsInteger<T, 1, false> {
+    static const uint8_t packedBits = 8;
+    static const eZPrefType kind = eZPrefUChar;
+    static T get(zPrefBase& c, const char* k, const T& d) { return c.nvs_getUChar(k, d); };
+    static size_t put(zPrefBase& c, const char* k, const T& v) { return c.nvs_putUChar(k, v); };
+};
+
+template<typename T>
+struct zPrefNvsInteger<T, 1, true> {
+    static const uint8_t packedBits = 8;
+    static const eZPrefType kind = eZPrefChar;
+    static T get(zPrefBase& c, const char* k, const T& d) { return c.nvs_getChar(k, d); };
+    static size_t put(zPrefBase& c, const char* k, const T& v) { return c.nvs_putChar(k, v); };
+};
+
+template<typename T>
+struct zPrefNvsInteger<T, 2, true> {
+    static const uint8_t packedBits = 16;
+    static const eZPrefType kind = eZPrefShort;
+    static T get(zPrefBase& c, const char* k, const T& d) { return c.nvs_getShort(k, d); };
+    static size_t put(zPrefBase& c, const char* k, const T& v) { return c.nvs_putShort(k, v); };
+};
+
+template<typename T>
+struct zPrefNvsInteger<T, 2, false> {
+    static const uint8_t packedBits = 16;
+    static const eZPrefType kind = eZPrefUShort;
+    static T get(zPrefBase& c, const char* k, const T& d) { return c.nvs_getUShort(k, d); };
+    static size_t put(zPrefBase& c, const char* k, const T& v) { return c.nvs_putUShort(k, v); };
+};
+
+template<typename T>
+struct zPrefNvsInteger<T, 4, true> {
+    static const uint8_t packedBits = 32;
+    static const eZPrefType kind = eZPrefInt;
+    static T get(zPrefBase& c, const char* k, const T& d) { return c.nvs_getInt(k, d); };
+    static size_t put(zPrefBase& c, const char* k, const T& v) { return c.nvs_putInt(k, v); };
+};
+
+template<typename T>
+struct zPrefNvsInteger<T, 4, false> {
+    static const uint8_t packedBits = 32;
+    static const eZPrefType kind = eZPrefUInt;
+    static T get(zPrefBase& c, const char* k, const T& d) { return c.nvs_getUInt(k, d); };
+    static size_t put(zPrefBase& c, const char* k, const T& v) { return c.nvs_putUInt(k, v); };
+};
+
+template<typename T>
+struct zPrefNvsInteger<T, 8, true> {
+    static const uint8_t packedBits = 64;
+    static const eZPrefType kind = eZPrefLong64;
+    static T get(zPrefBase& c, const char* k, const T& d) { return c.nvs_getLong64(k, d); };
+    static size_t put(zPrefBase& c, const char* k, const T& v) { return c.nvs_putLong64(k, v); };
+};
+
+template<typename T>
+struct zPrefNvsInteger<T, 8, false> {
+    static const uint8_t packedBits = 64;
+    static const eZPrefType kind = eZPrefULong64;
+    static T get(zPrefBase& c, const char* k, const T& d) { return c.nvs_getULong64(k, d); };
+    static size_t put(zPrefBase& c, const char* k, const T& v) { return c.nvs_putULong64(k, v); };
+};
+
+template<> struct zPrefNvs<signed char> : zPrefNvsInteger<signed char> {};
+template<> struct zPrefNvs<unsigned char> : zPrefNvsInteger<unsigned char> {};
+template<> struct zPrefNvs<short> : zPrefNvsInteger<short> {};
+template<> struct zPrefNvs<unsigned short> : zPrefNvsInteger<unsigned short> {};
+template<> struct zPrefNvs<int> : zPrefNvsInteger<int> {};
+template<> struct zPrefNvs<unsigned int> : zPrefNvsInteger<unsigned int> {};
+template<> struct zPrefNvs<long> : zPrefNvsInteger<long> {};
+template<> struct zPrefNvs<unsigned long> : zPrefNvsInteger<unsigned long> {};
+template<> struct zPrefNvs<long long> : zPrefNvsInteger<long long> {};
+template<> struct zPrefNvs<unsigned long long> : zPrefNvsInteger<unsigned long long> {};
+
+// Floating point values are stored as their raw bits - no conversion, exact round trip
+template<>
+struct zPrefNvs<float> {
+    static const uint8_t packedBits = 32;
+    static const eZPrefType kind = eZPrefFloat;
+    static float get(zPrefBase& c, const char* k, const float& d) {
+        uint32_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        bits = c.nvs_getUInt(k, bits);
+        float v;
+        memcpy(&v, &bits, sizeof(v));
+        return v;
+    };
+    static size_t put(zPrefBase& c, const char* k, const float& v) {
+        uint32_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        return c.nvs_putUInt(k, bits);
+    };
+};
+
+template<>
+struct zPrefNvs<double> {
+    static const uint8_t packedBits = 64;
+    static const eZPrefType kind = eZPrefDouble;
+    static double get(zPrefBase& c, const char* k, const double& d) {
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        bits = c.nvs_getULong64(k, bits);
+        double v;
+        memcpy(&v, &bits, sizeof(v));
+        return v;
+    };
+    static size_t put(zPrefBase& c, const char* k, const double& v) {
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        return c.nvs_putULong64(k, bits);
+    };
+};
+
+// Fixed-size arrays are stored as a blob of their elements, a size mismatch reads as the default
+template<typename E, size_t N>
+struct zPrefNvs<std::array<E, N>> {
+    static_assert(std::is_scalar<E>::value, "zPref: only arrays of scalars are supported");
+    static const eZPrefType kind = eZPrefArray;
+    static std::array<E, N> get(zPrefBase& c, const char* k, const std::array<E, N>& d) {
+        std::array<E, N> v;
+        return (c.nvs_getBlob(k, v.data(), sizeof(v)) == sizeof(v)) ? v : d;
+    };
+    static size_t put(zPrefBase& c, const char* k, const std::array<E, N>& v) {
+        return c.nvs_putBlob(k, v.data(), sizeof(v));
+    };
+};
+
+template<typename T>
+void zPrefVariable<T>::initialize() {
+    ZPREF_LOCK_WRITES(_config);
+    if (initialized) return;    // Loaded by another task while waiting for the lock
+    ZPREF_TIMESTAMP(start);
+    zPrefShardScope shard(_config, _shard);
+    if (_group != nullptr) {
+        _group->Load();         // Fills this and every other member of the group
+    } else if (!_stored) {
+        cache(T(_default));     // Not in NVS at Init and not written since - no lookup
+    } else {
+        cache(zPrefNvs<T>::get(_config, _key, _default));
+    }
+    ZPREF_RECORD(_readLatency, start);
+    initialized = true;
+}
+
+template<typename T>
+size_t zPrefVariable<T>::write(const T& val) {
+    ZPREF_TIMESTAMP(start);
+    zPrefShardScope shard(_config, _shard);
+    _config.touchShard(_shard);
+    // Packed members are written from the cached values, which already hold val
+    size_t ret;
+    if (_group != nullptr) {
+        ret = _group->Write(this);
+    } else {
+        ret = zPrefNvs<T>::put(_config, _key, val);
+        _stored = true;
+        _config.countWrite(this, zPrefEntryBytes(val));
+    }
+    ZPREF_RECORD(_writeLatency, start);
+    return ret;
+}
+
+/**
+ * @brief Large string or binary variable stored in a caller-provided buffer
+ *
+ * Unlike zPrefVariable<String>, the value is read by NVS straight into the
+ * buffer - no intermediate String, no heap allocation. The buffer holds the
+ * cached value, so Data() and c_str() are valid as long as the buffer is.
+ * Values larger than the buffer are not loaded, the default is used instead.
+ *
+ * Writes are never staged or deferred: in a batch or in write-behind mode the
+ * value is written immediately, only the commit is deferred. AbortBatch() does
+ * not revert a blob write.
+ *
+ * Declare with zPrefBlobOf<N>/zPrefTextOf<N> in ZPREF_VARIABLES for a buffer
+ * inside the class, with zPrefArenaBlobOf<N>/zPrefArenaTextOf<N> for a buffer
+ * in the configuration arena bound at Init, or construct directly over an
+ * external buffer:
+ * @code
+ * uint8_t certBuffer[4096];
+ * zPrefBlob Cert{"Cert", nullptr, *this, certBuffer, sizeof(certBuffer), eZPrefText};
+ * @endcode
+ */
+class zPrefBlob : public zPrefVariableBase {
+    private:
+        zPrefBase&          _config;
+        uint8_t *           _buffer;
+        size_t              _capacity;
+        const size_t        _arenaSize;         // Non-zero for arena-backed variables
+        const eZPrefType    _kind;
+        const char * const  _default;
+        size_t              _size = 0;          // Excluding the terminator of text values
+        bool                _writing = false;   // Between BeginWrite() and EndWrite()
+
+        void initialize();
+        void load(const uint8_t* data, size_t len);
+        size_t write();
+        size_t maxSize() { return ((_kind == eZPrefText) && (_capacity > 0)) ? _capacity - 1 : _capacity; };
+
+    protected:
+        size_t Persist() { return write(); };
+        void Rollback() {};
+        void Preload(bool present);
+        size_t Serialize(uint8_t * const, size_t) { return 0; };
+        bool Deserialize(const uint8_t * const, size_t) { return false; };
+        size_t Encode(uint8_t * const buf, size_t len);
+        bool Accepts(const uint8_t * const data, size_t len) {
+            return (len <= maxSize()) && ((_kind != eZPrefText) || (memchr(data, '\0', len) == nullptr));
         };
+        size_t Assign(const uint8_t * const data, size_t len) { return Set(data, len); };
+        size_t ArenaSize() { return (_buffer == nullptr) ? _arenaSize : 0; };
+        void BindArena(uint8_t * const buf);
+        size_t ExportValue(Print& out, char * const scratch, size_t len);
+
+    public:
+        /**
+         * @param def Default value as a NUL terminated string - may be nullptr
+         * @param buffer Storage for the value, nullptr to take capacity bytes from the arena
+         * @param kind eZPrefBlob or eZPrefText. Text values need room for the terminator
+         */
+        zPrefBlob(const char * const key, const char * const def, zPrefBase& config,
+            void * buffer, size_t capacity, eZPrefType kind = eZPrefBlob);
+        zPrefBlob(const zPrefBlob&) = delete;
+        zPrefBlob& operator=(const zPrefBlob&) = delete;
+
+        eZPrefType Kind() { return _kind; };
+        size_t Capacity() { return maxSize(); };
+
+        /**
+         * @brief Size of the value in bytes, loads it from NVS on first access
+         */
+        size_t Size();
+        const uint8_t * Data();
+        const char * c_str() { return (const char *)Data(); };
+
+        /**
+         * @brief Copy up to len bytes of the value starting at offset
+         * @return Number of bytes copied
+         */
+        size_t Read(void * dst, size_t len, size_t offset = 0);
+
+        /**
+         * @brief Write the whole value to out
+         * @return Number of bytes written
+         */
+        size_t WriteTo(Print& out);
+
+        /**
+         * @brief Replace the value and write it to NVS
+         * @return Number of bytes written, 0 on error or if the value does not fit
+         */
+        size_t Set(const void * data, size_t len);
+        size_t Set(const char * value) { return Set(value, strlen(value)); };
+        size_t operator=(const char * value) { return Set(value); };
+        size_t SetDefault();
+        eStatus Subscribe(zPrefObserver fn, void * ctx = nullptr) { return _config.Subscribe(this, fn, ctx); };
+
+        /**
+         * @brief Streamed write - the chunks are assembled in the buffer and written by EndWrite()
+         * Readers see the partial value until EndWrite()
+         */
+        void BeginWrite();
+        size_t Append(const void * data, size_t len);
+        size_t EndWrite();
+
+        /**
+         * @brief Read len bytes from in straight into the buffer and write them to NVS
+         * @return Number of bytes written, 0 on error or timeout
+         */
+        size_t ReadFrom(Stream& in, size_t len);
+
+        // Text values as is, binary values hex encoded
+        size_t FromString(const char * const value);
+        bool GetString(char * const buf, size_t len, size_t * const required = nullptr);
+        String GetString();
+};
+
+/**
+ * @brief zPrefBlob with its buffer inside the configuration class
+ */
+template<size_t N, eZPrefType K>
+class zPrefInlineBlob : public zPrefBlob {
+    private:
+        uint8_t _storage[N];
+
+    public:
+        zPrefInlineBlob(const char * const key, const char * const def, zPrefBase& config) :
+            zPrefBlob(key, def, config, _storage, N, K) {};
+        using zPrefBlob::operator=;
+};
+
+/**
+ * @brief Type tags to declare blobs in ZPREF_VARIABLES
+ * Usage: X(zPrefTextOf<2048>, Cert) - N bytes of buffer, including the terminator for text
+ */
+template<size_t N> struct zPrefBlobOf {};
+template<size_t N> struct zPrefTextOf {};
+template<size_t N> struct zPrefArenaBlobOf {};
+template<size_t N> struct zPrefArenaTextOf {};
+
+/**
+ * @brief zPrefBlob with its buffer in the configuration arena
+ */
+template<size_t N, eZPrefType K>
+class zPrefArenaBlob : public zPrefBlob {
+    public:
+        zPrefArenaBlob(const char * const key, const char * const def, zPrefBase& config) :
+            zPrefBlob(key, def, config, nullptr, N, K) {};
+        using zPrefBlob::operator=;
 };
 
-// Type aliases for common types
-//typedef bool Bool;
-//typedef uint16_t UShort;
-//typedef uint8_t UChar;
-//typedef int64_t Long64;
+/**
+ * @brief Counter incremented in RAM and persisted on thresholds
+ *
+ * Add() is a lock-free atomic add with ZPREF_THREAD_SAFE. The value is
+ * written when it has grown by the delta threshold since the last write,
+ * on the first Add() after the interval elapsed, or by Flush() and End().
+ * The writes rotate over N keys - the variable key followed by a hex digit,
+ * so keys are limited to 14 characters - and Init() takes the largest slot.
+ * Init() fails when another variable has the key of a slot.
+ * Set() rewrites every slot, so a lowered value survives a reboot. Use a
+ * 64-bit counter if the value can wrap. Observers and deltas see the counter
+ * when it is written, not on every Add().
+ *
+ * Declare with zPrefCounterOf<T, N> in ZPREF_VARIABLES:
+ * @code
+ * #define CONFIG_DEFAULT_BootCount   0
+ * #define MYCONFIG_VARIABLES(X) X(zPrefCounterOf<uint32_t>, BootCount)
+ *
+ * Config.BootCount.SetThresholds(100, 10 * 60 * 1000);
+ * Config.BootCount++;
+ * @endcode
+ */
+template<typename T, uint8_t N>
+class zPrefCounter : public zPrefVariableBase {
+    static_assert(std::is_unsigned<T>::value && (sizeof(T) >= 4), "zPref: counters are 32 or 64-bit unsigned");
+    static_assert((N >= 1) && (N <= 16), "zPref: counters rotate over 1 to 16 keys");
+
+    private:
+        zPrefBase&              _config;
+        const T                 _default;
+        zPrefAtomic<T>          _value{0};
+        zPrefAtomic<T>          _persisted{0};      // Value of the newest slot
+        zPrefAtomic<uint32_t>   _lastWriteMs{0};
+        zPrefFlag               _queued{false};     // In the pending counters of the config
+        uint8_t                 _slot = 0;          // Next slot to write
+        T                       _deltaThreshold = 0;
+        uint32_t                _intervalMs = ZPREF_COUNTER_INTERVAL_MS;
 
-// Helper macros for creating getter/setter implementations
-#define GETTER_IMPL_Bool    [this](String _k, Bool _d){ return this->nvs_getBool(_k.c_str(), _d); }
-#define SETTER_IMPL_Bool    [this](String _k, Bool _v){ size_t ret = this->nvs_putBool(_k.c_str(), _v); this->commit(); return ret; }
-#define GETTER_IMPL_UChar   [this](String _k, UChar _d){ return this->nvs_getUChar(_k.c_str(), _d); }
-#define SETTER_IMPL_UChar   [this](String _k, UChar _v){ size_t ret = this->nvs_putUChar(_k.c_str(), _v); this->commit(); return ret; }
-#define GETTER_IMPL_UShort  [this](String _k, UShort _d){ return this->nvs_getUShort(_k.c_str(), _d); }
-#define SETTER_IMPL_UShort  [this](String _k, UShort _v){ size_t ret = this->nvs_putUShort(_k.c_str(), _v); this->commit(); return ret; }
-#define GETTER_IMPL_Long64  [this](String _k, Long64 _d){ return this->nvs_getLong64(_k.c_str(), _d); }
-#define SETTER_IMPL_Long64  [this](String _k, Long64 _v){ size_t ret = this->nvs_putLong64(_k.c_str(), _v); this->commit(); return ret; }
-#define GETTER_IMPL_String  [this](String _k, String _d){ return this->nvs_getString(_k.c_str(), _d); }
-#define SETTER_IMPL_String  [this](String _k, String _v){ size_t ret = this->nvs_putString(_k.c_str(), _v); this->commit(); return ret; }
+        static nvs_type_t nvsType() { return (sizeof(T) == 8) ? NVS_TYPE_U64 : NVS_TYPE_U32; }
+
+        void initialize();
+        size_t writeSlot(uint8_t slot, T val);
+        size_t write();
+        size_t persistDue(T val);
+
+    protected:
+        size_t Persist() {
+            _queued = false;    // Taken off the pending counters by Flush() - an Add() from now on queues again
+            return write();
+        };
+        void Rollback() {};
+        void Preload(bool) { initialize(); };     // Slot keys are not seen by the Init key scan
+        size_t Serialize(uint8_t * const, size_t) { return 0; };
+        bool Deserialize(const uint8_t * const, size_t) { return false; };
+        size_t Encode(uint8_t * const buf, size_t len) { return zPrefEncode(Get(), buf, len); };
+        bool Accepts(const uint8_t * const data, size_t len) { T val; return zPrefDecode(data, len, val); };
+        size_t Assign(const uint8_t * const data, size_t len) {
+            T val;
+            return zPrefDecode(data, len, val) ? Set(val) : 0;
+        };
+
+    public:
+        zPrefCounter(const char * const key, const T& defaultVal, zPrefBase& config) :
+            zPrefVariableBase(key), _config(config), _default(defaultVal) {};
+        zPrefCounter(const zPrefCounter&) = delete;
+        zPrefCounter& operator=(const zPrefCounter&) = delete;
+
+        eZPrefType Kind() { return zPrefNvs<T>::kind; };
+        uint8_t CounterSlots() { return N; };
+
+        /**
+         * @brief Value including the increments not yet written
+         */
+        T Get() {
+            if (!initialized) initialize();
+            return _value;
+        };
+        T operator()() { return Get(); };
+
+        /**
+         * @brief Increment in RAM, writes only when a threshold is reached
+         * @return T - the new value
+         */
+        T Add(T delta = 1) {
+            if (!initialized) initialize();
+            T val = (_value += delta);
+            bool due = ((_deltaThreshold > 0) && (val - _persisted >= _deltaThreshold)) ||
+                ((_intervalMs > 0) && (millis() - _lastWriteMs >= _intervalMs));
+            if (due || !_queued) {
+                persistDue(val);
+            }
+            return val;
+        };
+        T operator+=(T delta) { return Add(delta); };
+        T operator++() { return Add(1); };
+        T operator++(int) { return Add(1) - 1; };
+
+        /**
+         * @brief Persist after growing by delta or on the first Add() after intervalMs
+         * @param delta Growth since the last write, 0 to disable
+         * @param intervalMs Time since the last write, 0 to disable
+         *
+         * With both disabled the value is only written by Flush(), End() and Set().
+         */
+        void SetThresholds(T delta, uint32_t intervalMs) {
+            _deltaThreshold = delta;
+            _intervalMs = intervalMs;
+        };
+
+        /**
+         * @brief Replace the value and write it to every slot
+         * @return Number of bytes written, 0 on error
+         */
+        size_t Set(T val);
+        size_t operator=(T val) { return Set(val); };
+        size_t SetDefault() { return Set(_default); };
+        eStatus Subscribe(zPrefObserver fn, void * ctx = nullptr) { return _config.Subscribe(this, fn, ctx); };
+
+        size_t FromString(const char * const val) {
+            T parsed = T();
+            if (zPrefParse(val, parsed) != eConvOk) {
+                return 0;
+            }
+            return Set(parsed);
+        };
+        String GetString() { return zPrefToString(Get()); };
+        bool GetString(char * const buf, size_t len, size_t * const required = nullptr) {
+            size_t needed = zPrefFormat(Get(), buf, len);
+            if (required) {
+                *required = needed + 1;
+            }
+            return needed < len;
+        };
+};
+
+template<typename T, uint8_t N>
+void zPrefCounter<T, N>::initialize() {
+    ZPREF_LOCK_WRITES(_config);
+    if (initialized) return;    // Loaded by another task while waiting for the lock
+    ZPREF_TIMESTAMP(start);
+
+    // The newest slot holds the largest value
+    bool found = false;
+    T newest = _default;
+    for (uint8_t slot = 0; slot < N; slot++) {
+        T val;
+        if (_config.readCounterSlot(this, slot, nvsType(), &val) && (!found || (val > newest))) {
+            found = true;
+            newest = val;
+            _slot = (slot + 1) % N;
+        }
+    }
+    _value = newest;
+    _persisted = newest;
+    _lastWriteMs = millis();
+    ZPREF_RECORD(_readLatency, start);
+    initialized = true;
+}
+
+template<typename T, uint8_t N>
+size_t zPrefCounter<T, N>::writeSlot(uint8_t slot, T val) {
+    ZPREF_TIMESTAMP(start);
+    size_t ret = _config.writeCounterSlot(this, slot, nvsType(), &val, sizeof(val));
+    ZPREF_RECORD(_writeLatency, start);
+    return ret;
+}
+
+// Writes the next slot, the caller commits and notifies
+template<typename T, uint8_t N>
+size_t zPrefCounter<T, N>::write() {
+    T val = _value;
+    if (val == _persisted) {
+        return 0;               // Nothing added since the last write
+    }
+    size_t ret = writeSlot(_slot, val);
+    if (ret != 0) {
+        _slot = (_slot + 1) % N;
+        _persisted = val;
+    }
+    _lastWriteMs = millis();
+    return ret;
+}
+
+// Slow path of Add() - queue for Flush(), or write now when a threshold is reached
+template<typename T, uint8_t N>
+size_t zPrefCounter<T, N>::persistDue(T val) {
+    ZPREF_LOCK_STATE(_config);
+    bool due = ((_deltaThreshold > 0) && (val - _persisted >= _deltaThreshold)) ||
+        ((_intervalMs > 0) && (millis() - _lastWriteMs >= _intervalMs));
+    if (!due) {
+        if (!_queued) {
+            _queued = true;
+            _config.queueCounter(this);
+        }
+        return 0;
+    }
+    size_t ret;
+    {
+        ZPREF_LOCK_STORAGE(_config);
+        ret = write();
+        _config.commit();
+    }
+    if (ret != 0) {
+        _config.notify(this);
+    }
+    return ret;
+}
+
+template<typename T, uint8_t N>
+size_t zPrefCounter<T, N>::Set(T val) {
+    ZPREF_LOCK_WRITES(_config);
+    if (!initialized) initialize();
+    _value = val;
+    size_t ret = sizeof(val);
+    for (uint8_t slot = 0; slot < N; slot++) {
+        if (writeSlot(slot, val) == 0) {
+            ret = 0;
+        }
+    }
+    _slot = 0;
+    _persisted = val;
+    _lastWriteMs = millis();
+    _config.commit();
+    _config.notify(this);
+    return ret;
+}
+
+template<typename T, uint8_t N = 4> struct zPrefCounterOf {};
+
+template<size_t N>
+struct zPrefNvs<zPrefBlobOf<N>> {
+    static const eZPrefType kind = eZPrefBlob;
+};
+
+template<size_t N>
+struct zPrefNvs<zPrefTextOf<N>> {
+    static const eZPrefType kind = eZPrefText;
+};
+
+template<size_t N>
+struct zPrefNvs<zPrefArenaBlobOf<N>> {
+    static const eZPrefType kind = eZPrefBlob;
+};
+
+template<size_t N>
+struct zPrefNvs<zPrefArenaTextOf<N>> {
+    static const eZPrefType kind = eZPrefText;
+};
+
+template<typename T, uint8_t N>
+struct zPrefNvs<zPrefCounterOf<T, N>> {
+    static const eZPrefType kind = zPrefNvs<T>::kind;
+};
+
+/**
+ * @brief Variable class declared for a type - zPrefVariable unless overridden by a tag
+ */
+template<typename T>
+struct zPrefVar {
+    typedef zPrefVariable<T> type;
+};
+
+template<size_t N>
+struct zPrefVar<zPrefBlobOf<N>> {
+    typedef zPrefInlineBlob<N, eZPrefBlob> type;
+};
+
+template<size_t N>
+struct zPrefVar<zPrefTextOf<N>> {
+    typedef zPrefInlineBlob<N, eZPrefText> type;
+};
+
+template<size_t N>
+struct zPrefVar<zPrefArenaBlobOf<N>> {
+    typedef zPrefArenaBlob<N, eZPrefBlob> type;
+};
+
+template<size_t N>
+struct zPrefVar<zPrefArenaTextOf<N>> {
+    typedef zPrefArenaBlob<N, eZPrefText> type;
+};
+
+template<typename T, uint8_t N>
+struct zPrefVar<zPrefCounterOf<T, N>> {
+    typedef zPrefCounter<T, N> type;
+};
+
+/**
+ * @brief Longest key declarable for a type, checked by ZPREF_VARIABLES
+ */
+template<typename T>
+struct zPrefKeyMax {
+    static const size_t value = NVS_KEY_NAME_MAX_SIZE - 1;
+};
+
+// Counter slot keys append a hex digit
+template<typename T, uint8_t N>
+struct zPrefKeyMax<zPrefCounterOf<T, N>> {
+    static const size_t value = NVS_KEY_NAME_MAX_SIZE - 2;
+};
 
 // Macro to declare a configuration variable
 // Usage: DECLARE_CONFIG_VARIABLE(String, MyVarName)
 // Requires: CONFIG_DEFAULT_MyVarName to be defined
-#define DECLARE_CONFIG_VARIABLE(type, name)  zPrefVariable <type> name = zPrefVariable <type>(#name, CONFIG_DEFAULT_##name, *this, GETTER_IMPL_##type, SETTER_IMPL_##type)
+// Note: only variables declared through ZPREF_VARIABLES are known by key
+#define DECLARE_CONFIG_VARIABLE(vtype, name)  zPrefVar<vtype>::type name{#name, CONFIG_DEFAULT_##name, *this}
+
+// Building blocks of ZPREF_VARIABLES, one expansion per list entry
+#define ZPREF_DECLARE_MEMBER(vtype, name) \
+    static_assert(sizeof(#name) <= zPrefKeyMax<vtype>::value + 1, \
+        "zPref: key " #name " exceeds 15 characters, 14 for counters"); \
+    DECLARE_CONFIG_VARIABLE(vtype, name);
+#define ZPREF_COUNT_MEMBER(vtype, name)     + 1
+#define ZPREF_MEMBER_ADDRESS(vtype, name)   &name,
+#define ZPREF_SCHEMA_ENTRY(vtype, name)     { #name, zPrefNvs<vtype>::kind },
+
+// Macro to declare all configuration variables of a class from an X-macro list
+// Usage:
+//   #define MYCONFIG_VARIABLES(X)  X(String, DeviceName) X(UShort, ServerPort)
+//   class MyConfig : public zPref {
+//       public:
+//           ZPREF_VARIABLES(MYCONFIG_VARIABLES)
+//   };
+// Declares the members, a flash-resident schema table and a fixed-size variable
+// table - no registration or heap allocation at construction. Key length is checked
+// at compile time; duplicate keys are duplicate members and fail to compile.
+// Leaves the following declarations public.
+#define ZPREF_VARIABLES(LIST) \
+        LIST(ZPREF_DECLARE_MEMBER) \
+    private: \
+        enum { kZPrefVariableCount = 0 LIST(ZPREF_COUNT_MEMBER) }; \
+        zPrefVariableBase * const _zprefVariables[kZPrefVariableCount] = { LIST(ZPREF_MEMBER_ADDRESS) }; \
+        uint16_t _zprefIndex[kZPrefVariableCount]; \
+        uint16_t _zprefHashIndex[kZPrefVariableCount]; \
+    protected: \
+        zPrefRegistry registry() override { \
+            static const zPrefSchemaEntry schema[] = { LIST(ZPREF_SCHEMA_ENTRY) }; \
+            return zPrefRegistry{ _zprefVariables, _zprefIndex, schema, kZPrefVariableCount, _zprefHashIndex }; \
+        }; \
+    public:
+
+// Building blocks of ZPREF_PACKED_GROUP
+#define ZPREF_PACKED_BOOL_BITS(vtype, name)     + ((zPrefNvs<vtype>::packedBits == 1) ? 1 : 0)
+#define ZPREF_PACKED_INT_BYTES(vtype, name)     + ((zPrefNvs<vtype>::packedBits > 1) ? (zPrefNvs<vtype>::packedBits / 8) : 0)
+#define ZPREF_PACKED_IMAGE_SIZE(LIST) \
+    (zPrefPackedGroup::kHeaderSize + ((0 LIST(ZPREF_PACKED_BOOL_BITS)) + 7) / 8 + 7 + (0 LIST(ZPREF_PACKED_INT_BYTES)))
+
+// Macro to store a subset of the variables in a single NVS blob
+// Usage:
+//   #define MYCONFIG_FLAGS(X)  X(Bool, LedEnabled) X(UChar, Brightness)
+//   #define MYCONFIG_VARIABLES(X)  X(String, DeviceName) MYCONFIG_FLAGS(X)
+//   class MyConfig : public zPref {
+//       public:
+//           ZPREF_VARIABLES(MYCONFIG_VARIABLES)
+//           ZPREF_PACKED_GROUP(Flags, 1, MYCONFIG_FLAGS)
+//   };
+// The group name is the NVS key of the blob. The list members must also be part of
+// ZPREF_VARIABLES, which has to come first. Only scalar types can be packed - bump
+// the version when changing the list. Leaves the following declarations public.
+#define ZPREF_PACKED_GROUP(name, version, LIST) \
+    static_assert(sizeof(#name) <= NVS_KEY_NAME_MAX_SIZE, "zPref: key " #name " exceeds 15 characters"); \
+    private: \
+        zPrefVariableBase * const _zprefMembers_##name[0 LIST(ZPREF_COUNT_MEMBER)] = { LIST(ZPREF_MEMBER_ADDRESS) }; \
+        uint8_t _zprefImage_##name[ZPREF_PACKED_IMAGE_SIZE(LIST)] = {}; \
+    public: \
+        zPrefPackedGroup name{#name, version, *this, _zprefMembers_##name, \
+            sizeof(_zprefMembers_##name) / sizeof(_zprefMembers_##name[0]), \
+            _zprefImage_##name, sizeof(_zprefImage_##name)};
+
+// Macro to keep a consistent, double-buffered copy of scalar variables
+// Usage:
+//   #define MYCONFIG_TUNING(X)  X(float, Kp) X(float, Ki) X(UShort, PeriodMs)
+//   class MyConfig : public zPref {
+//       public:
+//           ZPREF_VARIABLES(MYCONFIG_VARIABLES)
+//           ZPREF_SNAPSHOT(Tuning, MYCONFIG_TUNING)
+//   };
+// Declares the struct TuningValues with a field per variable and the snapshot
+// Tuning of type TuningSnapshot. The list members must also be part of
+// ZPREF_VARIABLES, which has to come first. Leaves the following declarations public.
+#define ZPREF_SNAPSHOT_FIELD(vtype, name) \
+    vtype name; \
+    static_assert(std::is_scalar<vtype>::value, "zPref: only scalar variables can be in a snapshot");
+#define ZPREF_SNAPSHOT_OFFSET(vtype, name)  offsetof(zprefValues_t, name),
+#define ZPREF_SNAPSHOT(name, LIST) \
+    public: \
+        struct name##Values { LIST(ZPREF_SNAPSHOT_FIELD) }; \
+        typedef zPrefSnapshot<name##Values> name##Snapshot; \
+    private: \
+        zPrefVariableBase * const _zprefMembers_##name[0 LIST(ZPREF_COUNT_MEMBER)] = { LIST(ZPREF_MEMBER_ADDRESS) }; \
+        static const size_t * _zprefOffsets_##name() { \
+            typedef name##Values zprefValues_t; \
+            static const size_t offsets[] = { LIST(ZPREF_SNAPSHOT_OFFSET) }; \
+            return offsets; \
+        }; \
+    public: \
+        name##Snapshot name{*this, _zprefMembers_##name, _zprefOffsets_##name(), \
+            sizeof(_zprefMembers_##name) / sizeof(_zprefMembers_##name[0])};
 
 //==============================================================================
 //  Exported data
@@ -0,0 +1,274 @@
+/*==============================================================================
+   zPref - NVS-backed preferences library for ESP32
+
+   Copyright 2020-2026 Ivan Vasilev, Zmei Research Ltd.
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+  ============================================================================*/
+
+//==============================================================================
+//  Includes
+//==============================================================================
+#include <string.h>
+#include "zPrefStorage.h"
+#include "esp_idf_version.h"
+
+//==============================================================================
+//  Defines
+//==============================================================================
+
+//==============================================================================
+//  Local types
+//==============================================================================
+
+//==============================================================================
+//  Local function definitions
+//==============================================================================
+
+//==============================================================================
+//  Local data
+//==============================================================================
+
+//==============================================================================
+//  Local functions
+//==============================================================================
+
+//==============================================================================
+//  Exported data
+//==============================================================================
+
+//==============================================================================
+//  NVS backend
+//==============================================================================
+esp_err_t zPrefNvsStorage::InitPartition(const char * partition)
+{
+    return nvs_flash_init_partition(partition);
+}
+
+esp_err_t zPrefNvsStorage::ErasePartition(const char * partition)
+{
+    return nvs_flash_erase_partition(partition);
+}
+
+esp_err_t zPrefNvsStorage::Open(const char * partition, const char * ns)
+{
+    _partition = partition;
+    _namespace = ns;
+    return nvs_open_from_partition(partition, ns, NVS_READWRITE, &_handle);
+}
+
+void zPrefNvsStorage::Close()
+{
+    if (_handle != 0) {
+        nvs_close(_handle);
+        _handle = 0;
+    }
+}
+
+esp_err_t zPrefNvsStorage::Get(const char * key, nvs_type_t type, void * out, size_t * len)
+{
+    switch (type) {
+        case NVS_TYPE_I8:   return nvs_get_i8(_handle, key, (int8_t*)out);
+        case NVS_TYPE_U8:   return nvs_get_u8(_handle, key, (uint8_t*)out);
+        case NVS_TYPE_I16:  return nvs_get_i16(_handle, key, (int16_t*)out);
+        case NVS_TYPE_U16:  return nvs_get_u16(_handle, key, (uint16_t*)out);
+        case NVS_TYPE_I32:  return nvs_get_i32(_handle, key, (int32_t*)out);
+        case NVS_TYPE_U32:  return nvs_get_u32(_handle, key, (uint32_t*)out);
+        case NVS_TYPE_I64:  return nvs_get_i64(_handle, key, (int64_t*)out);
+        case NVS_TYPE_U64:  return nvs_get_u64(_handle, key, (uint64_t*)out);
+        case NVS_TYPE_STR:  return nvs_get_str(_handle, key, (char*)out, len);
+        case NVS_TYPE_BLOB: return nvs_get_blob(_handle, key, out, len);
+        default:            return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+}
+
+esp_err_t zPrefNvsStorage::Set(const char * key, nvs_type_t type, const void * data, size_t len)
+{
+    switch (type) {
+        case NVS_TYPE_I8:   return nvs_set_i8(_handle, key, *(const int8_t*)data);
+        case NVS_TYPE_U8:   return nvs_set_u8(_handle, key, *(const uint8_t*)data);
+        case NVS_TYPE_I16:  return nvs_set_i16(_handle, key, *(const int16_t*)data);
+        case NVS_TYPE_U16:  return nvs_set_u16(_handle, key, *(const uint16_t*)data);
+        case NVS_TYPE_I32:  return nvs_set_i32(_handle, key, *(const int32_t*)data);
+        case NVS_TYPE_U32:  return nvs_set_u32(_handle, key, *(const uint32_t*)data);
+        case NVS_TYPE_I64:  return nvs_set_i64(_handle, key, *(const int64_t*)data);
+        case NVS_TYPE_U64:  return nvs_set_u64(_handle, key, *(const uint64_t*)data);
+        case NVS_TYPE_STR:  return nvs_set_str(_handle, key, (const char*)data);
+        case NVS_TYPE_BLOB: return nvs_set_blob(_handle, key, data, len);
+        default:            return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+}
+
+esp_err_t zPrefNvsStorage::Erase(const char * key)
+{
+    return nvs_erase_key(_handle, key);
+}
+
+esp_err_t zPrefNvsStorage::Commit()
+{
+    return nvs_commit(_handle);
+}
+
+esp_err_t zPrefNvsStorage::ForEachKey(KeyCallback fn, void * ctx)
+{
+    nvs_entry_info_t info;
+    nvs_iterator_t it = NULL;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    esp_err_t err = nvs_entry_find(_partition, _namespace, NVS_TYPE_ANY, &it);
+    while (err == ESP_OK) {
+        nvs_entry_info(it, &info);
+        fn(info.key, ctx);
+        err = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+    // The end of the namespace reads as not found, anything else failed the scan
+    return (err == ESP_ERR_NVS_NOT_FOUND) ? ESP_OK : err;
+#else
+    it = nvs_entry_find(_partition, _namespace, NVS_TYPE_ANY);
+    while (it != NULL) {
+        nvs_entry_info(it, &info);
+        fn(info.key, ctx);
+        it = nvs_entry_next(it);
+    }
+    nvs_release_iterator(it);
+    return ESP_OK;      // Errors end the iteration like the end of the namespace does
+#endif
+}
+
+esp_err_t zPrefNvsStorage::Stats(nvs_stats_t * stats, size_t * namespaceEntries)
+{
+    esp_err_t err = nvs_get_stats(_partition, stats);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return nvs_get_used_entry_count(_handle, namespaceEntries);
+}
+
+//==============================================================================
+//  In-memory backend
+//==============================================================================
+esp_err_t zPrefMemoryStorage::ErasePartition(const char * partition)
+{
+    (void)partition;
+    _entries.clear();
+    return ESP_OK;
+}
+
+esp_err_t zPrefMemoryStorage::Open(const char * partition, const char * ns)
+{
+    (void)partition;
+    if (_open && (_namespace != ns)) {
+        // Every other call works on the open namespace, see the class comment
+        return ESP_ERR_INVALID_STATE;
+    }
+    _namespace = ns;
+    _open = true;
+    return ESP_OK;
+}
+
+esp_err_t zPrefMemoryStorage::Get(const char * key, nvs_type_t type, void * out, size_t * len)
+{
+    gets++;
+    auto it = _entries.find(entryKey(key));
+    if (it == _entries.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    const Entry& e = it->second;
+    if (e.type != type) {
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+
+    bool sized = (type == NVS_TYPE_STR) || (type == NVS_TYPE_BLOB);
+    if (sized && (out == NULL)) {
+        *len = e.data.size();
+        return ESP_OK;
+    }
+    if (sized && (*len < e.data.size())) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out, e.data.data(), e.data.size());
+    if (sized) {
+        *len = e.data.size();
+    }
+    return ESP_OK;
+}
+
+esp_err_t zPrefMemoryStorage::Set(const char * key, nvs_type_t type, const void * data, size_t len)
+{
+    sets++;
+    if (strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    if (type == NVS_TYPE_STR) {
+        len = strlen((const char*)data) + 1;
+    } else if (type != NVS_TYPE_BLOB) {
+        len = type & 0x0F;      // Scalar width in bytes, per the nvs_type_t encoding
+    }
+
+    Entry& e = _entries[entryKey(key)];
+    e.type = type;
+    e.data.assign((const uint8_t*)data, (const uint8_t*)data + len);
+    return ESP_OK;
+}
+
+esp_err_t zPrefMemoryStorage::Erase(const char * key)
+{
+    sets++;
+    return (_entries.erase(entryKey(key)) > 0) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t zPrefMemoryStorage::ForEachKey(KeyCallback fn, void * ctx)
+{
+    std::string prefix = _namespace + '\0';
+    for (auto it = _entries.lower_bound(prefix); it != _entries.end(); ++it) {
+        if (it->first.compare(0, prefix.size(), prefix) != 0) {
+            break;
+        }
+        fn(it->first.c_str() + prefix.size(), ctx);
+    }
+    return ESP_OK;
+}
+
+esp_err_t zPrefMemoryStorage::Stats(nvs_stats_t * stats, size_t * namespaceEntries)
+{
+    // Entries as NVS would use them - one per scalar, a header plus 32 byte chunks otherwise
+    std::string prefix = _namespace + '\0';
+    memset(stats, 0, sizeof(*stats));
+    *namespaceEntries = 0;
+    std::string lastNamespace;
+    for (const auto& it : _entries) {
+        const std::vector<uint8_t>& data = it.second.data;
+        bool sized = (it.second.type == NVS_TYPE_STR) || (it.second.type == NVS_TYPE_BLOB);
+        size_t entries = sized ? 1 + (data.size() + 31) / 32 : 1;
+        stats->used_entries += entries;
+        if (it.first.compare(0, prefix.size(), prefix) == 0) {
+            *namespaceEntries += entries;
+        }
+        std::string ns = it.first.substr(0, it.first.find('\0'));
+        if (ns != lastNamespace) {
+            stats->namespace_count++;
+            lastNamespace = ns;
+        }
+    }
+    return ESP_OK;
+}
+
+//==============================================================================
+//  Exported functions
+//==============================================================================
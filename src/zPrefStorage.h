@@ -0,0 +1,180 @@
+/*==============================================================================
+   zPref - NVS-backed preferences library for ESP32
+
+   Copyright 2020-2026 Ivan Vasilev, Zmei Research Ltd.
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+  ============================================================================*/
+
+//==============================================================================
+//  Multi-include guard
+//==============================================================================
+#pragma once
+
+//==============================================================================
+//  Includes
+//==============================================================================
+#include <map>
+#include <string>
+#include <vector>
+#include "nvs_flash.h"
+#include "nvs.h"
+
+//==============================================================================
+//  Defines
+//==============================================================================
+
+//==============================================================================
+//  Exported types
+//==============================================================================
+
+/**
+ * @brief Key-value storage behind the zPrefBase nvs_get/nvs_put helpers
+ *
+ * Mirrors the NVS C API: values are typed with nvs_type_t and errors are
+ * reported as esp_err_t. Get() takes the buffer size in len and returns the
+ * value size in it; for strings and blobs out may be NULL to query the size.
+ * String sizes include the terminator. Set() only writes - Commit() makes the
+ * writes durable.
+ */
+class zPrefStorage {
+    public:
+        typedef void (*KeyCallback)(const char * key, void * ctx);
+
+        virtual ~zPrefStorage() {};
+
+        virtual esp_err_t InitPartition(const char * partition) = 0;
+        virtual esp_err_t ErasePartition(const char * partition) = 0;
+        virtual esp_err_t Open(const char * partition, const char * ns) = 0;
+        virtual void Close() = 0;
+
+        virtual esp_err_t Get(const char * key, nvs_type_t type, void * out, size_t * len) = 0;
+        virtual esp_err_t Set(const char * key, nvs_type_t type, const void * data, size_t len) = 0;
+        virtual esp_err_t Erase(const char * key) = 0;
+        virtual esp_err_t Commit() = 0;
+
+        /**
+         * @brief Call fn for every key stored in the open namespace
+         */
+        virtual esp_err_t ForEachKey(KeyCallback fn, void * ctx) = 0;
+
+        /**
+         * @brief Entry usage of the partition and the number of entries of the open namespace
+         */
+        virtual esp_err_t Stats(nvs_stats_t *, size_t *) { return ESP_ERR_NOT_SUPPORTED; };
+
+        // Scalar shorthands
+        template<typename V>
+        esp_err_t GetValue(const char * key, nvs_type_t type, V * out) {
+            size_t len = sizeof(V);
+            return Get(key, type, out, &len);
+        };
+        template<typename V>
+        esp_err_t SetValue(const char * key, nvs_type_t type, V value) {
+            return Set(key, type, &value, sizeof(V));
+        };
+};
+
+/**
+ * @brief The default backend - an NVS namespace on flash
+ */
+class zPrefNvsStorage : public zPrefStorage {
+    private:
+        nvs_handle_t    _handle = 0;
+        const char *    _partition = nullptr;
+        const char *    _namespace = nullptr;
+
+    public:
+        esp_err_t InitPartition(const char * partition);
+        esp_err_t ErasePartition(const char * partition);
+        esp_err_t Open(const char * partition, const char * ns);
+        void Close();
+
+        esp_err_t Get(const char * key, nvs_type_t type, void * out, size_t * len);
+        esp_err_t Set(const char * key, nvs_type_t type, const void * data, size_t len);
+        esp_err_t Erase(const char * key);
+        esp_err_t Commit();
+        esp_err_t ForEachKey(KeyCallback fn, void * ctx);
+        esp_err_t Stats(nvs_stats_t * stats, size_t * namespaceEntries);
+
+        nvs_handle_t& Handle() { return _handle; };
+};
+
+/**
+ * @brief In-memory backend for host builds, tests and benchmarks
+ *
+ * Like an NVS handle, an instance has one namespace open at a time: Open()
+ * of another namespace fails until Close(). Configurations with the same
+ * namespace can share an instance to simulate a reboot - Init() a second
+ * configuration over the same storage. For other namespaces of the same
+ * simulated partition, construct an instance over the first one. Nothing
+ * survives a reboot. Counts the calls it receives.
+ * @code
+ * zPrefMemoryStorage flash;
+ * zPrefMemoryStorage tuning(flash);    // Same entries, its own namespace
+ * @endcode
+ */
+class zPrefMemoryStorage : public zPrefStorage {
+    private:
+        struct Entry {
+            nvs_type_t              type;
+            std::vector<uint8_t>    data;
+        };
+
+        std::map<std::string, Entry>    _partition;
+        std::map<std::string, Entry>&   _entries;   // Keyed by namespace and key, possibly of another instance
+        std::string                     _namespace; // Kept after Close() to inspect the entries
+        bool                            _open = false;
+
+        std::string entryKey(const char * key) { return _namespace + '\0' + key; };
+
+    public:
+        uint32_t gets = 0;
+        uint32_t sets = 0;
+        uint32_t commits = 0;
+
+        zPrefMemoryStorage() : _entries(_partition) {};
+
+        /**
+         * @param partition Instance holding the entries, must outlive this one
+         */
+        explicit zPrefMemoryStorage(zPrefMemoryStorage& partition) : _entries(partition._entries) {};
+        zPrefMemoryStorage(const zPrefMemoryStorage&) = delete;
+        zPrefMemoryStorage& operator=(const zPrefMemoryStorage&) = delete;
+
+        esp_err_t InitPartition(const char *) { return ESP_OK; };
+        esp_err_t ErasePartition(const char * partition);
+        esp_err_t Open(const char * partition, const char * ns);
+        void Close() { _open = false; };
+
+        esp_err_t Get(const char * key, nvs_type_t type, void * out, size_t * len);
+        esp_err_t Set(const char * key, nvs_type_t type, const void * data, size_t len);
+        esp_err_t Erase(const char * key);
+        esp_err_t Commit() { commits++; return ESP_OK; };
+        esp_err_t ForEachKey(KeyCallback fn, void * ctx);
+        esp_err_t Stats(nvs_stats_t * stats, size_t * namespaceEntries);
+};
+
+//==============================================================================
+//  Exported data
+//==============================================================================
+
+//==============================================================================
+//  Exported functions
+//==============================================================================